@@ -0,0 +1,65 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <FL/fl_draw.H>
+
+#include "Canvas.H"
+
+#define FONT      FL_HELVETICA
+#define FONT_SIZE 8
+
+void
+FltkCanvas::color(Fl_Color c) {
+	fl_color(c);
+}
+
+void
+FltkCanvas::xyline(int x, int y, int x1) {
+	fl_xyline(x, y, x1);
+}
+
+void
+FltkCanvas::yxline(int x, int y, int y1) {
+	fl_yxline(x, y, y1);
+}
+
+void
+FltkCanvas::line(int x0, int y0, int x1, int y1, int width) {
+	fl_line_style(FL_SOLID | FL_CAP_ROUND | FL_JOIN_ROUND, width);
+	fl_begin_line();
+	fl_vertex(x0, y0);
+	fl_vertex(x1, y1);
+	fl_end_line();
+	fl_line_style(0);
+}
+
+void
+FltkCanvas::polygon(int x0, int y0, int x1, int y1, int x2, int y2) {
+	fl_polygon(x0, y0, x1, y1, x2, y2);
+}
+
+void
+FltkCanvas::circle(int x, int y, int r) {
+	fl_circle(x, y, r);
+}
+
+void
+FltkCanvas::text(const char *s, int x, int y) {
+	fl_font(FONT, FONT_SIZE);
+	fl_draw(s, x, y);
+}
+
+int
+FltkCanvas::text_width(const char *s) {
+	fl_font(FONT, FONT_SIZE);
+	return (int) fl_width(s);
+}
+
+int
+FltkCanvas::text_height() {
+	fl_font(FONT, FONT_SIZE);
+	return fl_height();
+}
@@ -0,0 +1,354 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "Panorama.H"
+#include "ImageMetaData.H"
+#include "Parallel.H"
+#include "ControlPoints.H"
+
+#define MAX_FIELDS 8
+
+ControlPoints::ControlPoints() {
+	points = NULL;
+	num_points = 0;
+	cap_points = 0;
+	images = NULL;
+	num_images = 0;
+	catalog = NULL;
+	robust = 0;
+	results = NULL;
+	pthread_mutex_init(&lock, NULL);
+}
+
+ControlPoints::~ControlPoints() {
+	for (int i = 0; i < num_points; i++) {
+		free(points[i].image);
+		free(points[i].name);
+	}
+
+	if (points)
+		free(points);
+	if (images)
+		free(images);
+	if (catalog)
+		delete catalog;
+
+	pthread_mutex_destroy(&lock);
+}
+
+void
+ControlPoints::add(const char *image, const char *name, double x, double y) {
+	if (num_points >= cap_points) {
+		cap_points = cap_points ? cap_points * 2 : 1024;
+		points = (point_t *) realloc(points, cap_points * sizeof(point_t));
+	}
+
+	points[num_points].image = strdup(image);
+	points[num_points].name = strdup(name);
+	points[num_points].x = x;
+	points[num_points].y = y;
+	num_points++;
+}
+
+// Split a CSV line in place. Fields may be enclosed in double quotes,
+// with "" denoting a literal quote.
+static int
+split_csv(char *line, char **fields, int max_fields) {
+	char *r = line, *w = line;
+	int n = 0;
+
+	while (n < max_fields) {
+		fields[n++] = w;
+
+		if (*r == '"') {
+			r++;
+			while (*r) {
+				if (*r == '"' && *(r + 1) == '"') {
+					*w++ = '"';
+					r += 2;
+				} else if (*r == '"') {
+					r++;
+					break;
+				} else {
+					*w++ = *r++;
+				}
+			}
+		}
+
+		while (*r && *r != ',' && *r != '\n' && *r != '\r')
+			*w++ = *r++;
+
+		if (*r != ',') {
+			*w = '\0';
+			break;
+		}
+
+		r++;
+		*w++ = '\0';
+	}
+
+	return n;
+}
+
+int
+ControlPoints::load(const char *file) {
+	FILE *fp;
+	char buf[4096];
+	char *vals[MAX_FIELDS];
+	char *end_x, *end_y;
+	double x, y;
+	int n, line = 0;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		perror("fopen");
+		return 1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		line++;
+
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+
+		n = split_csv(buf, vals, MAX_FIELDS);
+		if (n >= 4) {
+			x = strtod(vals[2], &end_x);
+			y = strtod(vals[3], &end_y);
+		}
+
+		if (n < 4 || end_x == vals[2] || end_y == vals[3]) {
+			if (line > 1) // ignore header line
+				fprintf(stderr, "%s:%d: invalid control point\n", file, line);
+			continue;
+		}
+
+		add(vals[0], vals[1], x, y);
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+void
+ControlPoints::find_sites(const char *name, Sites *candidates) {
+	int lo = 0, hi = catalog->get_num();
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (strcasecmp(catalog->get(mid)->name, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (int i = lo; i < catalog->get_num(); i++) {
+		Site *s = catalog->get(i);
+
+		if (strcasecmp(s->name, name) != 0)
+			break;
+
+		if (s->flags & Hill::TRACK_POINT)
+			continue;
+
+		candidates->add(s);
+	}
+}
+
+int
+ControlPoints::calibrate_image(const image_t *img) {
+	char *file = points[img->first].image;
+	ImageMetaData md;
+	Panorama pan;
+	Sites candidates;
+	Hills known(true), rejected;
+	Hills *close;
+	double v, k0, k1, x0;
+	int w, h, ret;
+
+	if (md.load_image(file) != 0 || md.image_width() <= 0) {
+		fprintf(stderr, "%s: Could not read image\n", file);
+		return 1;
+	}
+
+	if (isnan(md.latitude()) || isnan(md.longitude())) {
+		fprintf(stderr, "%s: Viewpoint unknown\n", file);
+		return 1;
+	}
+
+	w = md.image_width();
+	h = md.image_height();
+
+	for (int i = img->first; i < img->first + img->num; i++)
+		find_sites(points[i].name, &candidates);
+
+	// Only the candidate sites are added, so there is no point in
+	// restricting them to prominent ones.
+	pan.set_height_dist_ratio(-1.0);
+	pan.set_projection((ProjectionLSQ::Projection_t) md.projection_type());
+	pan.add_hills(&candidates);
+	pan.set_view_long(md.longitude());
+	pan.set_view_lat(md.latitude());
+	pan.set_view_height(isnan(md.height()) ? 0.0 : md.height());
+
+	v = md.direction();
+	pan.set_center_angle(isnan(v) ? 0.0 : v);
+	v = md.nick();
+	pan.set_nick_angle(isnan(v) ? 0.0 : v);
+	v = md.tilt();
+	pan.set_tilt_angle(isnan(v) ? 0.0 : v);
+	v = md.focal_length_35mm();
+	if (isnan(v) || v == 0.0)
+		v = 35.0;
+	pan.set_scale(v * (double) std::max(w, h) / 35.0);
+
+	md.distortion_params(&k0, &k1, &x0);
+	pan.set_distortion_params(isnan(k0) ? 0.0 : k0, isnan(k1) ? 0.0 : k1,
+		isnan(x0) ? 0.0 : x0);
+
+	// Resolve ambiguous names to the candidate closest to the viewpoint.
+	// The close hills exclude the viewpoint itself and have their
+	// distances computed.
+	close = pan.get_close_mountains();
+	for (int i = img->first; i < img->first + img->num; i++) {
+		Hill *best = NULL;
+
+		for (int j = 0; j < close->get_num(); j++) {
+			Hill *m = close->get(j);
+
+			if (strcasecmp(m->site->name, points[i].name) == 0 &&
+				!(m->flags & Hill::DUPLIC) &&
+				!known.contains(m) && (!best || m->dist < best->dist))
+				best = m;
+		}
+
+		if (!best) {
+			fprintf(stderr, "%s: Unknown hill %s\n", file, points[i].name);
+			continue;
+		}
+
+		best->x = points[i].x - w / 2;
+		best->y = points[i].y - h / 2;
+		known.add(best);
+	}
+
+	if (robust)
+		ret = pan.comp_params_robust(&known, &rejected);
+	else
+		ret = pan.comp_params(&known);
+
+	for (int i = 0; i < rejected.get_num(); i++)
+		fprintf(stderr, "%s: Rejected %s\n", file,
+			rejected.get(i)->site->name);
+
+	if (ret != 0) {
+		fprintf(stderr, "%s: Calibration failed\n", file);
+		return 1;
+	}
+
+	pan.get_distortion_params(&k0, &k1, &x0);
+
+	if (results) {
+		pthread_mutex_lock(&lock);
+		fprintf(results, "%s,%f,%f,%f,%f,%f,%f,%f,%d,%f,%f,%f\n",
+			file,
+			pan.get_view_long(),
+			pan.get_view_lat(),
+			pan.get_view_height(),
+			pan.get_center_angle(),
+			pan.get_nick_angle(),
+			pan.get_tilt_angle(),
+			pan.get_scale() * 35.0 / (double) std::max(w, h),
+			(int) pan.get_projection(),
+			k0, k1, x0);
+		pthread_mutex_unlock(&lock);
+
+		return 0;
+	} else {
+		md.longitude(pan.get_view_long());
+		md.latitude(pan.get_view_lat());
+		md.height(pan.get_view_height());
+		md.direction(pan.get_center_angle());
+		md.nick(pan.get_nick_angle());
+		md.tilt(pan.get_tilt_angle());
+		md.focal_length_35mm(pan.get_scale() * 35.0 / (double) std::max(w, h));
+		md.projection_type((int) pan.get_projection());
+		md.distortion_params(k0, k1, x0);
+
+		return md.save_image(file, file);
+	}
+}
+
+void
+ControlPoints::calibrate_job(int n, void *data) {
+	ControlPoints *cp = (ControlPoints *) data;
+	int ret;
+
+	ret = cp->calibrate_image(&cp->images[n]);
+
+	pthread_mutex_lock(&cp->lock);
+	cp->done++;
+	if (ret != 0)
+		cp->failed++;
+	if (cp->done % 1000 == 0)
+		fprintf(stderr, "%d of %d images done\n", cp->done, cp->num_images);
+	pthread_mutex_unlock(&cp->lock);
+}
+
+static int
+comp_points_image(const void *p1, const void *p2) {
+	return strcmp(*(char **) p1, *(char **) p2);
+}
+
+int
+ControlPoints::calibrate(const Sites *sites, int r, FILE *res) {
+	if (catalog)
+		delete catalog;
+
+	catalog = new Sites(sites);
+	catalog->sort_name();
+	robust = r;
+	results = res;
+	done = 0;
+	failed = 0;
+
+	// group control points by image
+	qsort(points, num_points, sizeof(point_t), comp_points_image);
+
+	if (images)
+		free(images);
+	images = (image_t *) malloc(std::max(num_points, 1) * sizeof(image_t));
+	num_images = 0;
+
+	for (int i = 0; i < num_points; i++) {
+		if (i == 0 || strcmp(points[i].image, points[i - 1].image) != 0) {
+			images[num_images].first = i;
+			images[num_images].num = 0;
+			num_images++;
+		}
+
+		images[num_images - 1].num++;
+	}
+
+	if (results)
+		fprintf(results, "# image,longitude,latitude,height,direction,nick,"
+			"tilt,focal_length_35mm,projection_type,k0,k1,x0\n");
+
+	ImageMetaData::init();
+	Parallel::run(num_images, calibrate_job, this);
+
+	fprintf(stderr, "Calibrated %d of %d images\n", done - failed, done);
+
+	return failed != 0;
+}
@@ -19,16 +19,38 @@
 #include <FL/Fl_JPEG_Image.H>
 #include <FL/Fl_Preferences.H>
 #include <FL/fl_draw.H>
+#include <FL/x.H>
 
 #include "Fl_Search_Chooser.H"
 #include "choose_hill.H"
 #include "ScanImage.H"
+#include "RasterCanvas.H"
 #include "GipfelWidget.H"
 
 #define CROSS_SIZE 2
+#define FLAG_WIDTH 10
+#define FLAG_HEIGHT 20
+#define MARK_MARGIN 4 // covers the cross, circle and text descent
+#define RENDER_BAND 64 // rows rendered at once by render()
 
 static double pi_d, deg2rad;
 
+static Fl_Preferences dist_prefs(Fl_Preferences::USER,
+	"Johannes.HofmannATgmx.de", "gipfel/DistortionProfiles");
+
+static int
+read_distortion_profile(const char *prof_name,
+	double *k0, double *k1, double *x0) {
+	int ret = 0;
+
+	Fl_Preferences prof(dist_prefs, prof_name);
+	ret += prof.get("k0", *k0, *k0);
+	ret += prof.get("k1", *k1, *k1);
+	ret += prof.get("x0", *x0, *x0);
+
+	return !ret;
+}
+
 GipfelWidget::GipfelWidget(int X,int Y,int W, int H, void (*changed_cb)()): Fl_Group(X, Y, W, H) {
 	end();
 	pi_d = asin(1.0) * 2.0;
@@ -37,42 +59,538 @@ GipfelWidget::GipfelWidget(int X,int Y,int W, int H, void (*changed_cb)()): Fl_G
 	pan = new Panorama();
 	cur_mountain = NULL;
 	focused_mountain = NULL;
-	known_hills = new Hills();
+	known_hills = new Hills(true);
 	img_file = NULL;
 	track_width = 200.0;
 	show_hidden = false;
+	reject_outliers = false;
 	have_gipfel_info = false;
 	md = new ImageMetaData();
+	track_sites = NULL;
 	track_points = NULL;
 	fl_register_images();
 	mouse_x = mouse_y = 0;
 	params_changed_cb = changed_cb;
+	snapshot = NULL;
+	published = NULL;
+	solved = false;
+	worker_running = false;
+	work = 0;
+	cancel = 0;
+	labels = NULL;
+	cap_labels = 0;
+	label_grid = new ScreenGrid();
+	mark_grid = new ScreenGrid();
+	label_height = 0;
+	canvas = new FltkCanvas();
+	raster = NULL;
+	overlay = 0;
+	overlay_valid = false;
+	pyramid = NULL;
+	image_loading = false;
+	image_load = NULL;
+	loaded_img = NULL;
+	data_loading = false;
+	data_load = NULL;
+	loading_file = NULL;
+	loaded_sites = NULL;
+	zoom_level = 0;
+	overlay_x = overlay_y = overlay_w = overlay_h = 0;
+	focus_x = focus_y = focus_w = focus_h = 0;
+	label_widths = NULL;
+	num_label_widths = cap_label_widths = 0;
+	pthread_mutex_init(&lock, NULL);
+	pthread_mutex_init(&snap_lock, NULL);
+	pthread_mutex_init(&cancel_lock, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	pan->set_cancel(cancelled, this);
 }
 
-int
-GipfelWidget::load_image(char *file) {
-	Fl_Image *new_img;
-	double direction, nick, tilt, fl;
+GipfelWidget::~GipfelWidget() {
+	if (worker_running) {
+		lock_pan();
+		unlock_pan(WORK_QUIT);
+		pthread_join(worker, NULL);
+	}
 
-	new_img = new Fl_JPEG_Image(file);
+	// Callbacks of the loaders may still be pending.
+	if (image_loading) {
+		pthread_join(image_loader, NULL);
+		image_load->g = NULL;
+		if (loaded_img)
+			delete loaded_img;
+	}
+
+	if (data_loading) {
+		pthread_join(data_loader, NULL);
+		data_load->g = NULL;
+		free(loading_file);
+		if (loaded_sites)
+			delete loaded_sites;
+	}
+
+	discard_snapshots();
+	if (labels)
+		free(labels);
+	if (label_widths)
+		free(label_widths);
+	delete label_grid;
+	delete mark_grid;
+	delete canvas;
+	if (overlay)
+		fl_delete_offscreen(overlay);
+	if (pyramid)
+		delete pyramid;
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&snap_lock);
+	pthread_mutex_destroy(&cancel_lock);
+	pthread_mutex_destroy(&lock);
+}
+
+// Move Panorama updates and parameter fitting to a background thread.
+// Without it they are done on the next draw().
+int
+GipfelWidget::start_worker() {
+	if (worker_running)
+		return 0;
 
-	if (new_img == NULL)
+	if (pthread_create(&worker, NULL, worker_main, this) != 0) {
+		perror("pthread_create");
 		return 1;
+	}
+
+	worker_running = true;
+
+	return 0;
+}
+
+// Get exclusive access to pan. A computation of the worker in progress
+// is cancelled instead of waited for.
+void
+GipfelWidget::lock_pan() {
+	pthread_mutex_lock(&cancel_lock);
+	cancel++;
+	pthread_mutex_unlock(&cancel_lock);
+
+	pthread_mutex_lock(&lock);
+
+	pthread_mutex_lock(&cancel_lock);
+	cancel--;
+	pthread_mutex_unlock(&cancel_lock);
+}
+
+// Whether someone waits in lock_pan().
+int
+GipfelWidget::cancelled(void *p) {
+	GipfelWidget *g = (GipfelWidget *) p;
+	int c;
+
+	pthread_mutex_lock(&g->cancel_lock);
+	c = g->cancel;
+	pthread_mutex_unlock(&g->cancel_lock);
+
+	return c;
+}
+
+// Release pan and schedule work w. Changes made in between are
+// coalesced, the worker only computes the latest state.
+void
+GipfelWidget::unlock_pan(int w) {
+	work |= w;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+
+	if (w && !worker_running)
+		redraw();
+}
+
+void *
+GipfelWidget::worker_main(void *p) {
+	GipfelWidget *g = (GipfelWidget *) p;
+	snapshot_t *s;
+	int w;
+
+	pthread_mutex_lock(&g->lock);
+
+	for (;;) {
+		// Wait until there is work and no one waits for the lock.
+		while (!g->work || cancelled(g))
+			pthread_cond_wait(&g->work_cond, &g->lock);
+
+		if (g->work & WORK_QUIT)
+			break;
+
+		w = g->work;
+		g->work = 0;
+
+		if (w & WORK_COMP_PARAMS) {
+			g->solve();
+
+			pthread_mutex_lock(&g->snap_lock);
+			g->solved = true;
+			pthread_mutex_unlock(&g->snap_lock);
+		}
+
+		// Positions of the known hills are kept after fitting, also
+		// when the update is cancelled and has to be done again.
+		if (g->pan->update(w & (WORK_COMP_PARAMS | WORK_KEEP_KNOWN) ?
+			g->known_hills : NULL) != 0) {
+			// cancelled, continue after the change
+			g->work |= WORK_UPDATE;
+			if (w & (WORK_COMP_PARAMS | WORK_KEEP_KNOWN))
+				g->work |= WORK_KEEP_KNOWN;
+			continue;
+		}
+
+		s = g->take_snapshot();
+
+		pthread_mutex_lock(&g->snap_lock);
+		if (g->published)
+			free_snapshot(g->published);
+		g->published = s;
+		pthread_mutex_unlock(&g->snap_lock);
+
+		Fl::awake(published_cb, g);
+	}
+
+	pthread_mutex_unlock(&g->lock);
+
+	return NULL;
+}
+
+// Called on the main thread after the worker published a snapshot.
+void
+GipfelWidget::published_cb(void *p) {
+	GipfelWidget *g = (GipfelWidget *) p;
+	snapshot_t *s;
+	bool solved;
+
+	pthread_mutex_lock(&g->snap_lock);
+	s = g->published;
+	g->published = NULL;
+	solved = g->solved;
+	g->solved = false;
+	pthread_mutex_unlock(&g->snap_lock);
+
+	if (!s) // already picked up
+		return;
+
+	g->install_snapshot(s);
+	g->redraw();
+
+	if (solved && g->params_changed_cb)
+		g->params_changed_cb();
+}
+
+// Copy the visible hills and track points of pan, with lock held.
+GipfelWidget::snapshot_t *
+GipfelWidget::take_snapshot() {
+	Hills *v = pan->get_visible_mountains();
+	int num_track = track_points ? track_points->get_num() : 0;
+	snapshot_t *s;
+
+	s = (snapshot_t *) malloc(sizeof(snapshot_t));
+	s->marks = (mark_t *) malloc(std::max(v->get_num(), 1) * sizeof(mark_t));
+	s->track = (mark_t *) malloc(std::max(num_track, 1) * sizeof(mark_t));
+	s->num_marks = 0;
+	s->num_track = 0;
+	s->scale = pan->get_scale();
+	s->zoom = 0;
+
+	for (int i = 0; i < v->get_num(); i++) {
+		Hill *m = v->get(i);
+		mark_t *k = &s->marks[s->num_marks++];
+
+		k->m = m;
+		k->x = m->x;
+		k->y = m->y;
+		k->dist = pan->get_real_distance(m);
+		k->flags = m->flags;
+		k->label_x = k->label_y = 0;
+	}
+
+	for (int i = 1; i < num_track; i++) {
+		Hill *m = track_points->get(i);
+		mark_t *k;
+
+		if (!(m->flags & Hill::VISIBLE))
+			continue;
+
+		k = &s->track[s->num_track++];
+		k->m = m;
+		k->x = m->x;
+		k->y = m->y;
+		k->dist = pan->get_real_distance(m);
+		k->flags = m->flags;
+		k->label_x = k->label_y = 0;
+	}
+
+	return s;
+}
+
+void
+GipfelWidget::free_snapshot(snapshot_t *s) {
+	free(s->marks);
+	free(s->track);
+	free(s);
+}
+
+void
+GipfelWidget::install_snapshot(snapshot_t *s) {
+	if (snapshot)
+		free_snapshot(snapshot);
+
+	snapshot = s;
+
+	if (snapshot) {
+		scale_marks(snapshot);
+		set_labels(snapshot);
+	}
+}
+
+// Convert the marks of s to screen coordinates at zoom_level.
+void
+GipfelWidget::scale_marks(snapshot_t *s) {
+	int e = s->zoom - zoom_level;
+
+	if (e == 0)
+		return;
+
+	for (int i = 0; i < s->num_marks; i++) {
+		s->marks[i].x = ldexp(s->marks[i].x, e);
+		s->marks[i].y = ldexp(s->marks[i].y, e);
+	}
+
+	for (int i = 0; i < s->num_track; i++) {
+		s->track[i].x = ldexp(s->track[i].x, e);
+		s->track[i].y = ldexp(s->track[i].y, e);
+	}
+
+	s->zoom = zoom_level;
+}
+
+// Show the image reduced by 2^level, 0 <= level < get_num_zoom_levels().
+void
+GipfelWidget::set_zoom_level(int level) {
+	if (!have_image() || level < 0 || level >= get_num_zoom_levels() ||
+		level == zoom_level)
+		return;
+
+	zoom_level = level;
+	size(pyramid->level_w(level), pyramid->level_h(level));
+
+	if (snapshot) {
+		scale_marks(snapshot);
+		set_labels(snapshot);
+	}
+
+	cur_mountain = NULL;
+	focused_mountain = NULL;
+	overlay_valid = false;
+	if (parent())
+		parent()->redraw();
+	redraw();
+}
+
+int
+GipfelWidget::get_zoom_level() {
+	return zoom_level;
+}
+
+int
+GipfelWidget::get_num_zoom_levels() {
+	return pyramid ? std::max(pyramid->get_num_levels(), 1) : 1;
+}
+
+// Called by the pyramid thread when a level got ready.
+void
+GipfelWidget::pyramid_ready_cb(void *p) {
+	Fl::awake(pyramid_awake_cb, p);
+}
+
+void
+GipfelWidget::pyramid_awake_cb(void *p) {
+	GipfelWidget *g = (GipfelWidget *) p;
+
+	// zoomed out views were sampled from a finer level so far
+	if (g->zoom_level > 0) {
+		g->overlay_valid = false;
+		g->redraw();
+	}
+}
+
+// Drop all snapshots, e.g. before hills they refer to are deleted.
+void
+GipfelWidget::discard_snapshots() {
+	install_snapshot(NULL);
+	clear_label_widths();
+
+	pthread_mutex_lock(&snap_lock);
+	if (published) {
+		free_snapshot(published);
+		published = NULL;
+	}
+	pthread_mutex_unlock(&snap_lock);
+}
+
+GipfelWidget::mark_t *
+GipfelWidget::find_mark(const Hill *m) {
+	if (!snapshot || !m)
+		return NULL;
+
+	for (int i = 0; i < snapshot->num_marks; i++)
+		if (snapshot->marks[i].m == m)
+			return &snapshot->marks[i];
+
+	return NULL;
+}
+
+// Fit the view parameters to known_hills, with lock held.
+int
+GipfelWidget::solve() {
+	int ret;
+
+	if (reject_outliers) {
+		Hills rejected;
+
+		ret = pan->comp_params_robust(known_hills, &rejected);
+		for (int i = 0; i < rejected.get_num(); i++)
+			fprintf(stderr, "Rejected %s\n", rejected.get(i)->site->name);
+	} else {
+		ret = pan->comp_params(known_hills);
+	}
+
+	return ret;
+}
+
+// Whether there is something to draw, the image or a preview of it.
+bool
+GipfelWidget::have_image() {
+	return img || (pyramid && pyramid->get_num_levels() > 0);
+}
+
+// Size of the full image, also while only the preview is there.
+int
+GipfelWidget::image_w() {
+	return img ? img->w() : pyramid ? pyramid->level_w(0) : 0;
+}
+
+int
+GipfelWidget::image_h() {
+	return img ? img->h() : pyramid ? pyramid->level_h(0) : 0;
+}
 
-	if (img)
+// The widget is valid while the thread runs, as it is joined before
+// the load is replaced or the widget is deleted.
+void *
+GipfelWidget::image_loader_main(void *p) {
+	load_t *l = (load_t *) p;
+
+	l->g->loaded_img = new Fl_JPEG_Image(l->g->img_file);
+	Fl::awake(image_loaded_cb, l);
+
+	return NULL;
+}
+
+// Called in the main thread. Ignores loads that are done already.
+void
+GipfelWidget::image_loaded_cb(void *p) {
+	load_t *l = (load_t *) p;
+
+	if (l->g)
+		l->g->finish_image_load();
+
+	free(l);
+}
+
+// Swap the decoded image in for the preview.
+void
+GipfelWidget::finish_image_load() {
+	pthread_join(image_loader, NULL);
+	image_loading = false;
+	image_load->g = NULL;
+	image_load = NULL;
+
+	if (loaded_img->w() != pyramid->level_w(0) ||
+		loaded_img->h() != pyramid->level_h(0)) {
+		fprintf(stderr, "Could not decode %s\n", img_file);
+		delete loaded_img;
+		loaded_img = NULL;
+		return;
+	}
+
+	img = loaded_img;
+	loaded_img = NULL;
+	pyramid->set_image(img);
+
+	overlay_valid = false;
+	redraw();
+}
+
+// With async set, only a reduced preview is decoded right away and the
+// image follows from a background thread, while the meta data is read.
+int
+GipfelWidget::load_image(char *file, bool async) {
+	double direction, nick, tilt, fl, k0, k1, x0;
+
+	if (image_loading)
+		finish_image_load();
+
+	// Stops building the old pyramid, which reads from img.
+	if (pyramid)
+		delete pyramid;
+	pyramid = NULL;
+
+	if (img) {
 		delete img;
+		img = NULL;
+	}
+
+	overlay_valid = false;
 
-	img = new_img;
+	pyramid = new ImagePyramid(pyramid_ready_cb, this);
+	zoom_level = 0;
 
 	if (img_file)
 		free(img_file);
 
 	img_file = strdup(file);
 
+	if (async && pyramid->load_jpeg_preview(file) == 0) {
+		image_load = (load_t *) malloc(sizeof(load_t));
+		image_load->g = this;
+
+		if (pthread_create(&image_loader, NULL, image_loader_main,
+			image_load) == 0) {
+			image_loading = true;
+		} else {
+			perror("pthread_create");
+			free(image_load);
+			image_load = NULL;
+		}
+	}
+
+	if (!image_loading) {
+		img = new Fl_JPEG_Image(file);
+		if (img->w() <= 0 || img->h() <= 0) {
+			delete img;
+			img = NULL;
+			return 1;
+		}
+
+		pyramid->set_image(img);
+	}
+
+	lock_pan();
 	known_hills->clear();
+	unlock_pan(0);
 
-	h(img->h());  
-	w(img->w());  
+	h(image_h());
+	w(image_w());
+	if (snapshot) { // rescale to zoom_level 0
+		scale_marks(snapshot);
+		set_labels(snapshot);
+	}
 
 	// try to retrieve gipfel data from JPEG meta data
 	md->load_image(file);
@@ -118,20 +636,22 @@ GipfelWidget::load_image(char *file) {
 	// 1. gipfel data in JPEG comment
 	// 2. matching distortion profile
 	// 3. set the to 0.0, 0.0
-	md->distortion_params(&pan->parms.k0, &pan->parms.k1, &pan->parms.x0);
-	if (isnan(pan->parms.k0)) {
+	md->distortion_params(&k0, &k1, &x0);
+	if (isnan(k0)) {
 		char buf[1024];
 		if (get_distortion_profile_name(buf, sizeof(buf)) == 0)
-			load_distortion_params(buf);
-
-		if (isnan(pan->parms.k0))
-			pan->parms.k0 = 0.0;
-		if (isnan(pan->parms.k1))
-			pan->parms.k1 = 0.0;
-		if (isnan(pan->parms.x0))
-			pan->parms.x0 = 0.0;
+			read_distortion_profile(buf, &k0, &k1, &x0);
+
+		if (isnan(k0))
+			k0 = 0.0;
+		if (isnan(k1))
+			k1 = 0.0;
+		if (isnan(x0))
+			x0 = 0.0;
 	}
 
+	set_distortion_params(k0, k1, x0);
+
 	return 0;
 }
 
@@ -142,6 +662,8 @@ GipfelWidget::get_image_filename() {
 
 int
 GipfelWidget::save_image(char *file) {
+	double k0, k1, x0;
+
 	if (img_file == NULL) {
 		fprintf(stderr, "Nothing to save\n");
 		return 1;
@@ -155,204 +677,600 @@ GipfelWidget::save_image(char *file) {
 	md->tilt(get_tilt_angle());
 	md->focal_length_35mm(get_focal_length_35mm());
 	md->projection_type((int) projection());
-	md->distortion_params(pan->parms.k0, pan->parms.k1, pan->parms.x0);
+	get_distortion_params(&k0, &k1, &x0);
+	md->distortion_params(k0, k1, x0);
 
 	return  md->save_image(img_file, file);
 }
 
+// See image_loader_main().
+void *
+GipfelWidget::data_loader_main(void *p) {
+	load_t *l = (load_t *) p;
+	GipfelWidget *g = l->g;
+	Sites *s = new Sites();
+
+	if (s->load(g->loading_file) != 0) {
+		fprintf(stderr, "Could not load datafile %s\n", g->loading_file);
+		delete s;
+		s = NULL;
+	}
+
+	g->loaded_sites = s;
+	Fl::awake(data_loaded_cb, l);
+
+	return NULL;
+}
+
+// Called in the main thread. Ignores loads that are done already.
+void
+GipfelWidget::data_loaded_cb(void *p) {
+	load_t *l = (load_t *) p;
+
+	if (l->g)
+		l->g->finish_data_load();
+
+	free(l);
+}
+
+// Add the sites parsed by the loader thread.
+void
+GipfelWidget::finish_data_load() {
+	pthread_join(data_loader, NULL);
+	data_loading = false;
+	data_load->g = NULL;
+	data_load = NULL;
+	free(loading_file);
+	loading_file = NULL;
+
+	if (loaded_sites) {
+		lock_pan();
+		pan->add_sites(loaded_sites);
+		unlock_pan(WORK_UPDATE);
+		loaded_sites = NULL;
+	}
+}
+
+// With async set, the file is parsed by a background thread and the
+// hills are added once the main loop runs. See loading_data().
 int
-GipfelWidget::load_data(const char *file) {
+GipfelWidget::load_data(const char *file, bool async) {
 	int r;
 
+	if (data_loading)
+		finish_data_load();
+
+	if (async) {
+		loading_file = strdup(file);
+		data_load = (load_t *) malloc(sizeof(load_t));
+		data_load->g = this;
+
+		if (pthread_create(&data_loader, NULL, data_loader_main,
+			data_load) == 0) {
+			data_loading = true;
+			return 0;
+		}
+
+		perror("pthread_create");
+		free(data_load);
+		data_load = NULL;
+		free(loading_file);
+		loading_file = NULL;
+	}
+
+	lock_pan();
 	r = pan->load_data(file);
-	set_labels(pan->get_visible_mountains());
+	unlock_pan(WORK_UPDATE);
 
 	return r;
 }
 
+// Add a hill for each of s without copying it, so widgets can share a
+// catalog. It must stay around as long as the widget.
+void
+GipfelWidget::add_hills(const Sites *s) {
+	lock_pan();
+	pan->add_hills(s);
+	unlock_pan(WORK_UPDATE);
+}
+
+bool
+GipfelWidget::loading_data() {
+	return data_loading;
+}
+
 int
 GipfelWidget::load_track(const char *file) {
+	int ret = 0;
+
+	lock_pan();
+
 	if (track_points) {
+		// snapshots point to the old track
+		discard_snapshots();
 		pan->remove_hills(Hill::TRACK_POINT);
-		track_points->clobber();
 		delete track_points;
+		track_points = NULL;
+		track_sites->clobber();
+		delete track_sites;
+		track_sites = NULL;
 	}
 
-	track_points = new Hills();
+	track_sites = new Sites();
 
-	if (track_points->load(file) != 0) {
-		delete track_points;
-		track_points = NULL;
-		return 1;
-	}
+	if (track_sites->load(file) != 0) {
+		delete track_sites;
+		track_sites = NULL;
+		ret = 1;
+	} else {
+		for (int i = 0; i < track_sites->get_num(); i++)
+			track_sites->get(i)->flags |= Hill::TRACK_POINT;
 
-	for (int i = 0; i < track_points->get_num(); i++)
-		track_points->get(i)->flags |= Hill::TRACK_POINT;
+		track_points = new Hills();
+		pan->add_hills(track_sites, track_points);  
+	}
 
-	pan->add_hills(track_points);  
-	redraw();
+	unlock_pan(WORK_UPDATE);
 
-	return 0;
+	return ret;
 }
 
 int
 GipfelWidget::set_viewpoint(const char *pos) {
 	int r;
 
+	lock_pan();
 	r = pan->set_viewpoint(pos);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
 	return r;
 }
 
 void
-GipfelWidget::set_viewpoint(const Hill *m) {
-	pan->set_viewpoint(m);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+GipfelWidget::set_viewpoint(const Hill *m) {
+	lock_pan();
+	pan->set_viewpoint(m);
+	unlock_pan(WORK_UPDATE);
+}
+
+static void
+draw_flag(Canvas *c, int x, int y) {
+	c->polygon(x, y - 10, x, y - FLAG_HEIGHT, x + FLAG_WIDTH, y - 15);
+	c->yxline(x, y, y - 10);
+	c->circle(x , y, 3);
+}
+
+// The part of the widget inside all of its parents, i.e. what an
+// enclosing Fl_Scroll shows of it, in window coordinates.
+void
+GipfelWidget::visible_box(int *X, int *Y, int *W, int *H) {
+	int x0 = x(), y0 = y(), x1 = x() + w(), y1 = y() + h();
+
+	for (Fl_Widget *p = parent(); p; p = p->parent()) {
+		if (p->as_window()) {
+			x0 = std::max(x0, 0);
+			y0 = std::max(y0, 0);
+			x1 = std::min(x1, p->w());
+			y1 = std::min(y1, p->h());
+			break;
+		}
+
+		x0 = std::max(x0, p->x());
+		y0 = std::max(y0, p->y());
+		x1 = std::min(x1, p->x() + p->w());
+		y1 = std::min(y1, p->y() + p->h());
+	}
+
+	*X = x0;
+	*Y = y0;
+	*W = std::max(x1 - x0, 0);
+	*H = std::max(y1 - y0, 0);
+}
+
+void 
+GipfelWidget::draw() {
+	int vx, vy, vw, vh, cx, cy, cw, ch;
+
+	if (!have_image())
+		return;
+
+	pyramid->start();
+	update_snapshot();
+
+	visible_box(&vx, &vy, &vw, &vh);
+	fl_clip_box(vx, vy, vw, vh, cx, cy, cw, ch);
+
+	// scrolling moves the widget, not the visible box
+	if (overlay_valid && (vx - x() != overlay_x || vy - y() != overlay_y ||
+		vw != overlay_w || vh != overlay_h))
+		overlay_valid = false;
+
+	// Render the visible part of image and marks into the overlay
+	// cache when all of it is drawn anyway. Partial redraws, e.g.
+	// while scrolling or dragging, are drawn directly.
+	if (!overlay_valid && vw > 0 && vh > 0 &&
+		cx == vx && cy == vy && cw == vw && ch == vh) {
+
+		if (overlay && (vw != overlay_w || vh != overlay_h)) {
+			fl_delete_offscreen(overlay);
+			overlay = 0;
+		}
+
+		if (!overlay)
+			overlay = fl_create_offscreen(vw, vh);
+
+		overlay_x = vx - x();
+		overlay_y = vy - y();
+		overlay_w = vw;
+		overlay_h = vh;
+
+		fl_begin_offscreen(overlay);
+		fl_push_clip(0, 0, vw, vh);
+		draw_view(x() - vx, y() - vy, 0, 0, vw, vh);
+		fl_pop_clip();
+		fl_end_offscreen();
+
+		overlay_valid = true;
+	}
+
+	fl_push_clip(x(), y(), w(), h());
+
+	if (overlay_valid)
+		fl_copy_offscreen(cx, cy, cw, ch, overlay, cx - vx, cy - vy);
+	else
+		draw_view(x(), y(), cx, cy, cw, ch);
+
+	draw_focus();
+
+	fl_pop_clip();
+}
+
+// Lay out and draw labels with the built-in font instead of FLTK's,
+// which needs a display, so render() can be used in batch mode.
+void
+GipfelWidget::set_headless() {
+	if (raster)
+		return;
+
+	delete canvas;
+	canvas = raster = new RasterCanvas();
+
+	clear_label_widths();
+	if (snapshot)
+		set_labels(snapshot);
+}
+
+// Write the image with marks, labels and track to out, RENDER_BAND
+// rows at a time, without a display. Needs set_headless() and the
+// decoded image at zoom level 0.
+int
+GipfelWidget::render(OutputImage *out) {
+	const unsigned char *src;
+	int W, H, d;
+
+	if (!raster || !img || img->count() != 1 || zoom_level != 0)
+		return 1;
+
+	W = img->w();
+	H = img->h();
+	d = img->d();
+	src = (const unsigned char *) img->data()[0];
+
+	if (d < 1 || out->init(W, H) != 0)
+		return 1;
+
+	update_snapshot();
+
+	for (int y0 = 0; y0 < H; y0 += RENDER_BAND) {
+		int n = std::min(RENDER_BAND, H - y0);
+		unsigned char *band = raster->set_band(W, y0, n);
+		const unsigned char *s = src + (long) y0 * W * d;
+
+		for (long i = 0; i < (long) W * n; i++, s += d) {
+			band[3 * i + 0] = s[0];
+			band[3 * i + 1] = s[d >= 3 ? 1 : 0];
+			band[3 * i + 2] = s[d >= 3 ? 2 : 0];
+		}
+
+		if (snapshot)
+			draw_marks(raster, 0, 0, 0, y0, W, n);
+
+		// as ScreenDump
+		raster->color(FL_YELLOW);
+		raster->text("created with gipfel", W - 80, H - 10);
+
+		for (int y = 0; y < n; y++)
+			out->write_row(band + (long) y * W * 3, OutputImage::RGB_8);
+	}
+
+	return out->done();
+}
+
+// Draw all of the widget, not only the part visible in an enclosing
+// scroll area, e.g. into an offscreen buffer.
+void
+GipfelWidget::draw_all() {
+	if (!have_image())
+		return;
+
+	fl_push_clip(x(), y(), w(), h());
+	draw_view(x(), y(), x(), y(), w(), h());
+	draw_focus();
+	fl_pop_clip();
+}
+
+// Without worker thread, the Panorama is updated when drawn.
+void
+GipfelWidget::update_snapshot() {
+	if (work && !worker_running) {
+		pthread_mutex_lock(&lock);
+		work = 0;
+		pan->update();
+		install_snapshot(take_snapshot());
+		pthread_mutex_unlock(&lock);
+	}
 }
 
-static void
-draw_flag(int x, int y) {
-	fl_polygon(x, y - 10, x, y - 20, x + 10, y - 15);
-	fl_yxline(x, y, y - 10);
-	fl_circle(x , y, 3);
+// Draw image, marks and track with the widget at X, Y. Only what is
+// inside cx, cy, cw, ch is drawn.
+void
+GipfelWidget::draw_view(int X, int Y, int cx, int cy, int cw, int ch) {
+	if (pyramid->get_num_levels() > 0)
+		pyramid->draw(zoom_level, cx, cy, cw, ch, cx - X, cy - Y);
+	else
+		img->draw(cx, cy, cw, ch, cx - X, cy - Y);
+
+	if (snapshot)
+		draw_marks(canvas, X, Y, cx, cy, cw, ch);
 }
 
-void 
-GipfelWidget::draw() {
-	Hills *mnts;
-	Hill *m;
-	int i, height;
+// Draw marks, labels and track of snapshot with c.
+void
+GipfelWidget::draw_marks(Canvas *c, int X, int Y, int cx, int cy,
+	int cw, int ch) {
+	mark_t *k;
+	const int *vis;
+	int i, height, num_vis;
 
-	if (img == NULL)
-		return;
+	/* hills */
 
-	fl_push_clip(x(), y(), w(), h());
-	img->draw(x(),y(),w(),h(),0,0);
+	// only marks in the part of the image on screen
+	vis = mark_grid->find(cx - X - w() / 2, cy - Y - h() / 2, cw, ch,
+		&num_vis);
 
-	/* hills */
-	fl_font(FL_HELVETICA, 8);
-	mnts = pan->get_visible_mountains();
+	c->color(FL_YELLOW);
+	height = c->text_height();
+	for (i=0; i<num_vis; i++) {
+		k = &snapshot->marks[vis[i]];
+		int m_x = w() / 2 + X + (int) rint(k->x);
+		int m_y = h() / 2 + Y + (int) rint(k->y);
 
-	fl_color(FL_YELLOW);
-	height = fl_height();
-	for (i=0; i<mnts->get_num(); i++) {
-		m = mnts->get(i);
-		int m_x = w() / 2 + x() + (int) rint(m->x);
-		int m_y = h() / 2 + y() + (int) rint(m->y);
-
-		if ((m->flags & (Hill::DUPLIC|Hill::TRACK_POINT)) ||
-			(!show_hidden && (m->flags & Hill::HIDDEN)) ||
-			known_hills->contains(m) || m == focused_mountain)
+		if ((k->flags & (Hill::DUPLIC|Hill::TRACK_POINT)) ||
+			(!show_hidden && (k->flags & Hill::HIDDEN)) ||
+			known_hills->contains(k->m))
 			continue;
 
-		if (fabs(m->x) > img->w() / 2 || fabs(m->y) > img->h() / 2)
+		if (fabs(k->x) > w() / 2 || fabs(k->y) > h() / 2)
 			continue;
 
-		fl_xyline(m_x - CROSS_SIZE, m_y, m_x + CROSS_SIZE);
-		fl_yxline(m_x, m_y + m->label_y - height, m_y + CROSS_SIZE);
-		fl_xyline(m_x, m_y + m->label_y - height, m_x + m->label_x);
+		c->xyline(m_x - CROSS_SIZE, m_y, m_x + CROSS_SIZE);
+		if (k->label_x == 0) { // label dropped
+			c->yxline(m_x, m_y - CROSS_SIZE, m_y + CROSS_SIZE);
+			continue;
+		}
+		c->yxline(m_x, m_y + k->label_y - height, m_y + CROSS_SIZE);
+		c->xyline(m_x, m_y + k->label_y - height, m_x + k->label_x);
 	}
 
-	for (i=0; i<mnts->get_num(); i++) {
-		m = mnts->get(i);
-		int m_x = w() / 2 + x() + (int) rint(m->x);
-		int m_y = h() / 2 + y() + (int) rint(m->y);
+	for (i=0; i<num_vis; i++) {
+		k = &snapshot->marks[vis[i]];
+		int m_x = w() / 2 + X + (int) rint(k->x);
+		int m_y = h() / 2 + Y + (int) rint(k->y);
 
-		if ((m->flags & (Hill::DUPLIC|Hill::TRACK_POINT)) ||
-			(!show_hidden && (m->flags & Hill::HIDDEN)) || m == focused_mountain)
+		if ((k->flags & (Hill::DUPLIC|Hill::TRACK_POINT)) ||
+			(!show_hidden && (k->flags & Hill::HIDDEN)))
 			continue;
 
-		if (fabs(m->x) > img->w() / 2 || fabs(m->y) > img->h() / 2)
+		if (fabs(k->x) > w() / 2 || fabs(k->y) > h() / 2)
 			continue;
 
-		if (known_hills->contains(m)) {
+		if (known_hills->contains(k->m)) {
 			if (known_hills->get_num() > 3)
-				fl_color(FL_GREEN);
+				c->color(FL_GREEN);
 			else
-				fl_color(FL_RED);
+				c->color(FL_RED);
 
-			draw_flag(m_x, m_y);
-			fl_color(FL_BLACK);
-		} else if (m->flags & Hill::HIDDEN) {
-			fl_color(FL_BLUE);
+			draw_flag(c, m_x, m_y);
+			c->color(FL_BLACK);
+		} else if (k->flags & Hill::HIDDEN) {
+			c->color(FL_BLUE);
 		} else {
-			fl_color(FL_BLACK);
+			c->color(FL_BLACK);
 		}
 
-		fl_draw(m->name, m_x + 2, m_y + m->label_y);
-	}
-
-	if (focused_mountain) {
-		m = focused_mountain;
-		int m_x = w() / 2 + x() + (int) rint(m->x);
-		int m_y = h() / 2 + y() + (int) rint(m->y);
-
-		fl_color(FL_YELLOW);
-
-		fl_rectf(m_x, m_y - height,
-			(int) fl_width(focused_mountain_label) + 2, height + 2);
-		fl_color(FL_BLACK);
-  		fl_draw(focused_mountain_label, m_x, m_y);
+		if (k->label_x > 0)
+			c->text(k->m->site->name, m_x + 2, m_y + k->label_y);
 	}
-	
 
 	/* track */
-	if (track_points && track_points->get_num() > 0) {
+	if (snapshot->num_track > 0) {
 		int last_x = 0, last_y = 0, last_initialized = 0;
 
-		for (i=1; i<track_points->get_num(); i++) {
-			m = track_points->get(i);
-			int m_x = w() / 2 + x() + (int) rint(m->x);
-			int m_y = h() / 2 + y() + (int) rint(m->y);
+		for (i=0; i<snapshot->num_track; i++) {
+			k = &snapshot->track[i];
+			int m_x = w() / 2 + X + (int) rint(k->x);
+			int m_y = h() / 2 + Y + (int) rint(k->y);
 
-			if (!(track_points->get(i)->flags & Hill::VISIBLE))
-				continue;
-
-			if (track_points->get(i)->flags & Hill::HIDDEN)
-				fl_color(FL_BLUE);
+			if (k->flags & Hill::HIDDEN)
+				c->color(FL_BLUE);
 			else
-				fl_color(FL_RED);
-
-			fl_line_style(FL_SOLID | FL_CAP_ROUND | FL_JOIN_ROUND,
-				get_rel_track_width(track_points->get(i)));
-			if (last_initialized) {
-				fl_begin_line();
-				fl_vertex(last_x, last_y);
-				fl_vertex(m_x, m_y);
-				fl_end_line();
-			}
+				c->color(FL_RED);
+
+			if (last_initialized)
+				c->line(last_x, last_y, m_x, m_y, get_rel_track_width(k));
 
 			last_x = m_x;
 			last_y = m_y;
 			last_initialized++;
 		}
-		fl_line_style(0);
 	}
+}
 
-	fl_pop_clip();
+// The label of the hill under the mouse, drawn on top of the overlay.
+void
+GipfelWidget::draw_focus() {
+	mark_t *k = find_mark(focused_mountain);
+
+	if (!k)
+		return;
+
+	fl_font(FL_HELVETICA, 8);
+	set_focus_box(k);
+
+	fl_color(FL_YELLOW);
+	fl_rectf(x() + focus_x, y() + focus_y, focus_w, focus_h);
+	fl_color(FL_BLACK);
+	fl_draw(focused_mountain_label, x() + focus_x,
+		y() + focus_y + focus_h - 2);
+}
+
+// Set the focused hill and repaint only the old and new focus label.
+void
+GipfelWidget::set_focus(mark_t *k) {
+	Hill *m = k ? k->m : NULL;
+
+	if (m == focused_mountain)
+		return;
+
+	if (focused_mountain)
+		damage(4, x() + focus_x, y() + focus_y, focus_w, focus_h);
+
+	focused_mountain = m;
+	if (!m)
+		return;
+
+	snprintf(focused_mountain_label, sizeof(focused_mountain_label) - 1,
+		"%s (%dm), distance %.2fkm",
+		m->site->name, (int) m->site->height, k->dist / 1000.0);
+
+	fl_font(FL_HELVETICA, 8);
+	set_focus_box(k);
+
+	damage(4, x() + focus_x, y() + focus_y, focus_w, focus_h);
+}
+
+// Place the focus label at k, the label font must be set.
+void
+GipfelWidget::set_focus_box(const mark_t *k) {
+	focus_x = w() / 2 + (int) rint(k->x);
+	focus_y = h() / 2 + (int) rint(k->y) - fl_height();
+	focus_w = (int) fl_width(focused_mountain_label) + 2;
+	focus_h = fl_height() + 2;
+}
+
+// Known hills first, then the most prominent ones, i.e. the ones the
+// Panorama keeps longest when decreasing the height distance ratio.
+int
+GipfelWidget::comp_label_priority(const void *p1, const void *p2) {
+	const label_t *l1 = (const label_t *) p1;
+	const label_t *l2 = (const label_t *) p2;
+
+	if (l1->known != l2->known)
+		return l2->known - l1->known;
+	else if (l1->ratio > l2->ratio)
+		return -1;
+	else if (l1->ratio < l2->ratio)
+		return 1;
+	else
+		return l1->index - l2->index;
+}
+
+static inline unsigned long
+hash_site(const Site *s) {
+	return ((unsigned long) s >> 4) * 2654435761UL;
 }
 
-static int 
-overlap(double x1, double l1, double x2, double l2) {
-	return x1 <= x2 + l2 && x1 + l1 >= x2;
+// Width of the name of s in the label font of canvas.
+int
+GipfelWidget::get_label_width(const Site *s) {
+	label_width_t *e;
+	unsigned long i;
+
+	if (2 * (num_label_widths + 1) > cap_label_widths) {
+		label_width_t *old = label_widths;
+		int old_cap = cap_label_widths;
+
+		cap_label_widths = cap_label_widths ? cap_label_widths * 2 : 1024;
+		label_widths = (label_width_t *) calloc(cap_label_widths,
+			sizeof(label_width_t));
+
+		for (int j = 0; j < old_cap; j++) {
+			if (!old[j].site)
+				continue;
+
+			i = hash_site(old[j].site) & (cap_label_widths - 1);
+			while (label_widths[i].site)
+				i = (i + 1) & (cap_label_widths - 1);
+			label_widths[i] = old[j];
+		}
+
+		if (old)
+			free(old);
+	}
+
+	i = hash_site(s) & (cap_label_widths - 1);
+	for (;;) {
+		e = &label_widths[i];
+
+		if (e->site == s)
+			return e->width;
+		else if (!e->site)
+			break;
+
+		i = (i + 1) & (cap_label_widths - 1);
+	}
+
+	e->site = s;
+	e->width = canvas->text_width(s->name) + 1;
+	num_label_widths++;
+
+	return e->width;
+}
+
+void
+GipfelWidget::clear_label_widths() {
+	if (label_widths)
+		memset(label_widths, 0, cap_label_widths * sizeof(label_width_t));
+	num_label_widths = 0;
 }
 
+// Place the labels of the hills in s above their markers. Labels are
+// placed in order of priority and moved up until they overlap neither
+// labels placed before nor markers. Labels that would have to leave
+// the image are dropped, except for known hills.
 void 
-GipfelWidget::set_labels(Hills *v) {
-	int height;
+GipfelWidget::set_labels(snapshot_t *s) {
+	int height, num_labels = 0;
 
-	if (!img)
+	if (!have_image()) {
+		mark_grid->reset(0, 0, 0, 0);
 		return;
+	}
+
+	if (s->num_marks > cap_labels) {
+		cap_labels = s->num_marks;
+		labels = (label_t *) realloc(labels, cap_labels * sizeof(label_t));
+	}
 
+	height = label_height = canvas->text_height();
 
-	fl_font(FL_HELVETICA, 8);
-	height = fl_height();
+	label_grid->reset(-w() / 2, -h() / 2, w(), h());
 
-	for (int i = 0; i < v->get_num(); i++) {
-		Hill *m = v->get(i);
-		Hills colliding;
+	for (int i = 0; i < s->num_marks; i++) {
+		mark_t *m = &s->marks[i];
+		label_t *l;
+
+		m->label_x = 0;
+		m->label_y = 0;
 
 		if (m->flags & (Hill::DUPLIC | Hill::TRACK_POINT))
 			continue;
@@ -360,46 +1278,85 @@ GipfelWidget::set_labels(Hills *v) {
 		if (!show_hidden && (m->flags & Hill::HIDDEN))
 			continue;
 
-		if (fabs(m->x) > img->w() / 2 || fabs(m->y) > img->h() / 2)
+		if (fabs(m->x) > w() / 2 || fabs(m->y) > h() / 2)
 			continue;
 
-		m->label_x = (int) fl_width(m->name) + 1;
-		m->label_y = 0;
+		l = &labels[num_labels];
+		l->k = m;
+		l->index = num_labels;
+		l->known = known_hills->contains(m->m);
+		l->ratio = m->m->site->height / std::max(m->dist, 1.0);
+		num_labels++;
 
-		for (int j = i - 1; j >= 0; j--) {
-			Hill *n = v->get(j);
+		label_grid->add((int) rint(m->x) - CROSS_SIZE,
+			(int) rint(m->y) - CROSS_SIZE,
+			2 * CROSS_SIZE, 2 * CROSS_SIZE, l->index);
+	}
 
-			if (n->flags & (Hill::DUPLIC | Hill::TRACK_POINT))
-				continue;
+	qsort(labels, num_labels, sizeof(label_t), comp_label_priority);
 
-			if (!show_hidden && (n->flags & Hill::HIDDEN))
-				continue;
+	for (int i = 0; i < num_labels; i++) {
+		label_t *l = &labels[i];
+		mark_t *m = l->k;
+		int x = (int) rint(m->x);
+		int y = (int) rint(m->y);
+		int top;
 
-			if (fabs(m->x) > img->w() / 2 || fabs(m->y) > img->h() / 2)
-				continue;
+		m->label_x = get_label_width(m->m->site);
 
-			if (overlap(m->x, m->label_x, n->x - CROSS_SIZE, n->label_x))
-				colliding.add(n);
-			else
+		// Check for overlapping labels and
+		// overlaps between labels and peak markers
+		while (label_grid->overlap(x, y + m->label_y - height,
+				m->label_x, height, l->index, &top)) {
+			m->label_y = top - y - 2;
+
+			if (y + m->label_y - height < -h() / 2 && !l->known)
 				break;
 		}
 
-		colliding.sort(Hills::SORT_LABEL_Y);
+		if (y + m->label_y - height < -h() / 2 && !l->known) {
+			m->label_x = 0;
+			m->label_y = 0;
+			continue;
+		}
+
+		label_grid->add(x, y + m->label_y - height, m->label_x, height,
+			l->index);
+	}
 
-		for (int j = 0; j < colliding.get_num(); j++) {
-			Hill *n = colliding.get(j);
+	mark_grid->reset(-w() / 2, -h() / 2, w(), h());
 
-			// Check for overlapping labels and
-			// overlaps between labels and peak markers
-			if (overlap(m->y + m->label_y - height, height,
-					n->y + n->label_y - height, height) ||
-				overlap(m->y + m->label_y - height,
-					height, n->y - CROSS_SIZE, 2 * CROSS_SIZE)) {
+	for (int i = 0; i < s->num_marks; i++)
+		add_mark(&s->marks[i]);
 
-				m->label_y = (int) rint(n->y + n->label_y - m->y - height - 2);
-			}
-		}
+	overlay_valid = false;
+}
+
+// Enter the area k may draw to into mark_grid, if k is on the image.
+void
+GipfelWidget::add_mark(const mark_t *k) {
+	int x = (int) rint(k->x);
+	int y = (int) rint(k->y);
+	int x0, y0, x1, y1;
+
+	if (!snapshot || !have_image() ||
+		fabs(k->x) > w() / 2 + MARK_MARGIN ||
+		fabs(k->y) > h() / 2 + MARK_MARGIN)
+		return;
+
+	// cross and flag of known hills
+	x0 = x - MARK_MARGIN;
+	x1 = x + FLAG_WIDTH + MARK_MARGIN;
+	y0 = y - FLAG_HEIGHT - MARK_MARGIN;
+	y1 = y + MARK_MARGIN;
+
+	if (k->label_x > 0) {
+		x1 = std::max(x1, x + 2 + k->label_x + MARK_MARGIN);
+		y0 = std::min(y0, y + k->label_y - label_height - MARK_MARGIN);
+		y1 = std::max(y1, y + k->label_y + MARK_MARGIN);
 	}
+
+	mark_grid->add(x0, y0, x1 - x0, y1 - y0, (int) (k - snapshot->marks));
 }
 
 Hill *
@@ -411,38 +1368,62 @@ GipfelWidget::find_mountain(Hills *mnts, int m_x, int m_y) {
     for (int i = 0; i < mnts->get_num(); i++) {
         m = mnts->get(i);
 
-        if (m_x - center_x >= m->x - 2 && m_x - center_x < m->x + 2 &&
-            m_y - center_y >= m->y - 2 && m_y - center_y < m->y + 2)
+        double x = ldexp(m->x, -zoom_level);
+        double y = ldexp(m->y, -zoom_level);
+
+        if (m_x - center_x >= x - 2 && m_x - center_x < x + 2 &&
+            m_y - center_y >= y - 2 && m_y - center_y < y + 2)
 			return m;
 	}
 
 	return NULL;
 }
 
-int
-GipfelWidget::toggle_known_mountain(int m_x, int m_y) {
-	Hills *mnts = pan->get_visible_mountains();
-	int center_x = w() / 2;
-	int center_y = h() / 2;
+// Return the first mark at widget position m_x, m_y with none of
+// skip_flags set.
+GipfelWidget::mark_t *
+GipfelWidget::find_mountain(int m_x, int m_y, int skip_flags) {
+	const int *found;
+	int num_found;
 
-	for (int i = 0; i < mnts->get_num(); i++) {
-		Hill *m = mnts->get(i); 
+	if (!snapshot)
+		return NULL;
 
-		if (m->flags & (Hill::DUPLIC | Hill::TRACK_POINT))
-			continue;
+	m_x -= w() / 2;
+	m_y -= h() / 2;
 
-		if (m_x - center_x >= m->x - 2 && m_x - center_x < m->x + 2 &&
-			m_y - center_y >= m->y - 2 && m_y - center_y < m->y + 2) {
+	found = mark_grid->find(m_x - 2, m_y - 2, 4, 4, &num_found);
 
+	for (int i = 0; i < num_found; i++) {
+		mark_t *k = &snapshot->marks[found[i]];
 
-			if (known_hills->contains(m))
-				known_hills->remove(m);
-			else
-				known_hills->add(m);
+		if (k->flags & skip_flags)
+			continue;
 
-			redraw();
-			return 0;
-		}
+		if (m_x >= k->x - 2 && m_x < k->x + 2 &&
+			m_y >= k->y - 2 && m_y < k->y + 2)
+			return k;
+	}
+
+	return NULL;
+}
+
+int
+GipfelWidget::toggle_known_mountain(int m_x, int m_y) {
+	mark_t *k = find_mountain(m_x, m_y, Hill::DUPLIC | Hill::TRACK_POINT);
+
+	if (k) {
+		lock_pan();
+		if (known_hills->contains(k->m))
+			known_hills->remove(k->m);
+		else
+			known_hills->add(k->m);
+		unlock_pan(0);
+
+		// known hills are labelled first
+		set_labels(snapshot);
+		redraw();
+		return 0;
 	}
 
 	cur_mountain = NULL;
@@ -455,97 +1436,284 @@ GipfelWidget::set_mountain(int m_x, int m_y) {
 	int old_x, old_y, old_label_y;
 	int center_x = w() / 2;
 	int center_y = h() / 2;
+	mark_t *k;
 
 	if (!cur_mountain)
 		return 1;
 
-	old_x = (int) rint(cur_mountain->x);
-	old_y = (int) rint(cur_mountain->y);
-	old_label_y = cur_mountain->label_y;
+	overlay_valid = false;
+
+	lock_pan();
+	cur_mountain->x = ldexp(m_x - center_x, zoom_level);
+	cur_mountain->y = ldexp(m_y - center_y, zoom_level);
+	unlock_pan(0);
+
+	// move the mark right away, the snapshot is not recomputed
+	k = find_mark(cur_mountain);
+	if (!k) {
+		redraw();
+		return 0;
+	}
 
-	cur_mountain->x = m_x - center_x;
-	cur_mountain->y = m_y - center_y;
-	cur_mountain->label_y = 0;
+	old_x = (int) rint(k->x);
+	old_y = (int) rint(k->y);
+	old_label_y = k->label_y;
+
+	k->x = m_x - center_x;
+	k->y = m_y - center_y;
+	k->label_y = 0;
+	add_mark(k); // the old entry is filtered out on lookup
 
 	damage(4, center_x + x() + old_x - 2*CROSS_SIZE - 1,
 		center_y + y() + old_y + old_label_y - 2*CROSS_SIZE - 20,
-		std::max(20, cur_mountain->label_x) + 2*CROSS_SIZE + 4,
+		std::max(20, k->label_x) + 2*CROSS_SIZE + 4,
 		std::max(20, old_label_y) + 22 ); 
 	damage(4,
-		(int) rint(center_x + x() + cur_mountain->x - 2*CROSS_SIZE - 1),
-		(int) rint(center_y + y() + cur_mountain->y + cur_mountain->label_y - 2*CROSS_SIZE - 20),
-		std::max(20, cur_mountain->label_x) + 2*CROSS_SIZE + 4,
-		std::max(20, cur_mountain->label_y) + 22 ); 
+		(int) rint(center_x + x() + k->x - 2*CROSS_SIZE - 1),
+		(int) rint(center_y + y() + k->y + k->label_y - 2*CROSS_SIZE - 20),
+		std::max(20, k->label_x) + 2*CROSS_SIZE + 4,
+		std::max(20, k->label_y) + 22 ); 
 
 	return 0;
 }
 
 void
 GipfelWidget::set_center_angle(double a) {
+	lock_pan();
 	pan->set_center_angle(a);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
 }
 
 void
 GipfelWidget::set_nick_angle(double a) {
+	lock_pan();
 	pan->set_nick_angle(a);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
 }
 
 void
 GipfelWidget::set_tilt_angle(double a) {
+	lock_pan();
 	pan->set_tilt_angle(a);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
 }
 
 void
 GipfelWidget::set_focal_length_35mm(double s) {
-	int w = std::max(img->w(), img->h()); // assume sensor is wider than high
+	int w = std::max(image_w(), image_h()); // assume sensor is wider than high
+
+	lock_pan();
 	pan->set_scale(s * (double) w / 35.0);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
 }
 
 void
 GipfelWidget::projection(ProjectionLSQ::Projection_t p) {
+	lock_pan();
 	pan->set_projection(p);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
+}
+
+ProjectionLSQ::Projection_t
+GipfelWidget::projection() {
+	ProjectionLSQ::Projection_t p;
+
+	lock_pan();
+	p = pan->get_projection();
+	unlock_pan(0);
+
+	return p;
 }
 
 void
 GipfelWidget::set_distortion_params(double k0, double k1, double x0) {
+	lock_pan();
 	pan->set_distortion_params(k0, k1, x0);
-	redraw();
+	unlock_pan(WORK_UPDATE);
+}
+
+void
+GipfelWidget::get_distortion_params(double *k0, double *k1, double *x0) {
+	lock_pan();
+	pan->get_distortion_params(k0, k1, x0);
+	unlock_pan(0);
 }
 
 double
 GipfelWidget::get_focal_length_35mm() {
+	double s;
 	int w;
 
-	if (img == NULL)
+	if (!have_image())
 		return NAN;
 	
-	w = std::max(img->w(), img->h()); // assume sensor is wider than high
-	return pan->get_scale() * 35.0 / (double) w;
+	w = std::max(image_w(), image_h()); // assume sensor is wider than high
+
+	lock_pan();
+	s = pan->get_scale();
+	unlock_pan(0);
+
+	return s * 35.0 / (double) w;
+}
+
+const char *
+GipfelWidget::get_viewpoint() {
+	const char *v;
+
+	lock_pan();
+	v = pan->get_viewpoint();
+	unlock_pan(0);
+
+	return v;
+}
+
+double
+GipfelWidget::get_center_angle() {
+	double v;
+
+	lock_pan();
+	v = pan->get_center_angle();
+	unlock_pan(0);
+
+	return v;
+}
+
+double
+GipfelWidget::get_nick_angle() {
+	double v;
+
+	lock_pan();
+	v = pan->get_nick_angle();
+	unlock_pan(0);
+
+	return v;
+}
+
+double
+GipfelWidget::get_tilt_angle() {
+	double v;
+
+	lock_pan();
+	v = pan->get_tilt_angle();
+	unlock_pan(0);
+
+	return v;
+}
+
+double
+GipfelWidget::get_height_dist_ratio() {
+	double v;
+
+	lock_pan();
+	v = pan->get_height_dist_ratio();
+	unlock_pan(0);
+
+	return v;
+}
+
+double
+GipfelWidget::get_view_lat() {
+	double v;
+
+	lock_pan();
+	v = pan->get_view_lat();
+	unlock_pan(0);
+
+	return v;
+}
+
+double
+GipfelWidget::get_view_long() {
+	double v;
+
+	lock_pan();
+	v = pan->get_view_long();
+	unlock_pan(0);
+
+	return v;
+}
+
+double
+GipfelWidget::get_view_height() {
+	double v;
+
+	lock_pan();
+	v = pan->get_view_height();
+	unlock_pan(0);
+
+	return v;
+}
+
+// Append all hills to h.
+void
+GipfelWidget::get_mountains(Hills *h) {
+	lock_pan();
+	h->add(pan->get_mountains());
+	unlock_pan(0);
+}
+
+// The visible hills within the image, as written by export_hills()
+// without an export file.
+void
+GipfelWidget::get_export_hills(Hills *hills) {
+	Hills *mnts;
+
+	if (!have_gipfel_info)
+		return;
+
+	lock_pan();
+
+	mnts = pan->get_visible_mountains();
+	for (int i = 0; i < mnts->get_num(); i++) {
+		Hill *m = mnts->get(i);
+		int _x = (int) rint(m->x) + w() / 2;
+		int _y = (int) rint(m->y) + h() / 2;
+
+		if (m->flags & Hill::DUPLIC || m->flags & Hill::HIDDEN)
+			continue;
+
+		if (_x < 0 || _x > w() || _y < 0 || _y > h())
+			continue;
+
+		hills->add(m);
+	}
+
+	unlock_pan(0);
+}
+
+double
+GipfelWidget::get_real_distance(const Hill *m) {
+	double d;
+
+	lock_pan();
+	d = pan->get_real_distance(m);
+	unlock_pan(0);
+
+	return d;
 }
 
 void 
 GipfelWidget::find_peak_cb(Fl_Widget *, void *f) {
 	GipfelWidget *g = (GipfelWidget*) f;
+	Hills close, *visible;
+	Hill *m;
 
-	Hill *m = choose_hill(g->pan->get_close_mountains(), "Find Peak");
+	g->lock_pan();
+	close.add(g->pan->get_close_mountains());
+	g->unlock_pan(0);
+
+	m = choose_hill(&close, "Find Peak");
 	if (m) {
+		g->lock_pan();
 		if (!g->known_hills->contains(m))
 			g->known_hills->add(m);
 
-		m->flags |= Hill::VISIBLE;
-		if (! g->pan->get_visible_mountains()->contains(m))
-			g->pan->get_visible_mountains()->add(m);
-		g->set_labels(g->pan->get_visible_mountains());
+		// The VISIBLE flag is left alone, it only tells whether
+		// m is in the visible range.
+		visible = g->pan->get_visible_mountains();
+		if (!visible->contains(m))
+			visible->add(m);
+		g->unlock_pan(0);
 
 		g->cur_mountain = m;
 		g->set_mountain(g->mouse_x, g->mouse_y);
@@ -556,70 +1724,88 @@ GipfelWidget::find_peak_cb(Fl_Widget *, void *f) {
 void 
 GipfelWidget::toggle_hidden_cb(Fl_Widget *, void *f) {
 	GipfelWidget *g = (GipfelWidget*) f;
+	mark_t *k = g->find_mountain(g->mouse_x, g->mouse_y);
 
-	Hill *m = g->find_mountain(g->pan->get_visible_mountains(), g->mouse_x, g->mouse_y);
-	if (!m)
+	if (!k)
 		return;
 
-	if (m->flags & Hill::HIDDEN)
-		m->flags &= ~Hill::HIDDEN;
+	g->lock_pan();
+	if (k->m->flags & Hill::HIDDEN)
+		k->m->flags &= ~Hill::HIDDEN;
 	else
-		m->flags |= Hill::HIDDEN;
-
-	g->set_labels(g->pan->get_visible_mountains());
-	g->redraw();
+		k->m->flags |= Hill::HIDDEN;
+	g->unlock_pan(WORK_UPDATE);
 }
 
 void
 GipfelWidget::set_height_dist_ratio(double r) {
+	lock_pan();
 	pan->set_height_dist_ratio(r);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
 }
 
 void
 GipfelWidget::set_hide_value(double h) {
+	lock_pan();
 	pan->set_hide_value(h);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
 }
 
 void
 GipfelWidget::set_show_hidden(bool h) {
 	show_hidden = h;
-	set_labels(pan->get_visible_mountains());
+	if (snapshot)
+		set_labels(snapshot);
 	redraw();
 }
 
 void
 GipfelWidget::set_view_lat(double v) {
+	lock_pan();
 	pan->set_view_lat(v);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
 }
 
 void
 GipfelWidget::set_view_long(double v) {
+	lock_pan();
 	pan->set_view_long(v);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
 }
 
 void
 GipfelWidget::set_view_height(double v) {
+	lock_pan();
 	pan->set_view_height(v);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	unlock_pan(WORK_UPDATE);
+}
+
+void
+GipfelWidget::set_reject_outliers(bool r) {
+	lock_pan();
+	reject_outliers = r;
+	unlock_pan(0);
+
+	if (known_hills->get_num() > 0)
+		comp_params();
 }
 
+// With the worker thread running, the fit is only scheduled and
+// params_changed_cb is called once it is done.
 int
 GipfelWidget::comp_params() {
 	int ret;
 
+	lock_pan();
+
+	if (worker_running) {
+		unlock_pan(WORK_COMP_PARAMS);
+		return 0;
+	}
+
 	fl_cursor(FL_CURSOR_WAIT);
-	ret = pan->comp_params(known_hills);
-	set_labels(pan->get_visible_mountains());
-	redraw();
+	ret = solve();
+	unlock_pan(WORK_UPDATE);
 	fl_cursor(FL_CURSOR_DEFAULT);
 	if (params_changed_cb)
 		params_changed_cb();
@@ -628,28 +1814,30 @@ GipfelWidget::comp_params() {
 }
 
 int
-GipfelWidget::get_rel_track_width(Hill *m) {
-	double dist = pan->get_real_distance(m);
-
-	return (int) rint(std::max((pan->get_scale()*track_width)/(dist*10.0), 1.0));
+GipfelWidget::get_rel_track_width(const mark_t *m) {
+	return (int) rint(std::max((snapshot->scale*track_width)/(m->dist*10.0), 1.0));
 }
 
 void
 GipfelWidget::set_track_width(double w) {
 	track_width = w;
+	overlay_valid = false;
 	redraw();
 }
 
 int
 GipfelWidget::handle(int event) {
 	Hill *m;
+	mark_t *k;
 
 	switch(event) {
 		case FL_PUSH:    
 			mouse_x = Fl::event_x()-x();
 			mouse_y = Fl::event_y()-y();
 			if (Fl::event_button() == FL_LEFT_MOUSE) {
+				lock_pan();
 				m = find_mountain(known_hills, mouse_x, mouse_y);
+				unlock_pan(0);
 				if (m)
 					cur_mountain = m;
 			} else if (Fl::event_button() == FL_MIDDLE_MOUSE) {
@@ -663,16 +1851,15 @@ GipfelWidget::handle(int event) {
 
 				Fl_Menu_Button rclick_menu(Fl::event_x_root(),
 					Fl::event_y_root(), 80, 1);
-				Hill *m = find_mountain(pan->get_visible_mountains(),
-					mouse_x, mouse_y);
+				k = find_mountain(mouse_x, mouse_y);
 				char buf[1024];
 
 				rclick_menu.add("Find Peak", 0, find_peak_cb, this);
-				if (m) {
-					if (m->flags & Hill::HIDDEN)
-						snprintf(buf, sizeof(buf), "Unhide %s", m->name);
+				if (k) {
+					if (k->flags & Hill::HIDDEN)
+						snprintf(buf, sizeof(buf), "Unhide %s", k->m->site->name);
 					else
-						snprintf(buf, sizeof(buf), "Hide %s", m->name);
+						snprintf(buf, sizeof(buf), "Hide %s", k->m->site->name);
 
 					rclick_menu.add(buf, 0, toggle_hidden_cb, this);
 				}
@@ -695,17 +1882,9 @@ GipfelWidget::handle(int event) {
 		case FL_LEAVE:
 			return 1;
 		case FL_MOVE:
-			m = find_mountain(pan->get_visible_mountains(), Fl::event_x()-x(), Fl::event_y()-y());
-			if (m != focused_mountain && (!m || !known_hills->contains(m))) {
-				if (m)
-					snprintf(focused_mountain_label,
-						sizeof(focused_mountain_label) - 1,
-						"%s (%dm), distance %.2fkm",
-						m->name, (int) m->height, pan->get_real_distance(m) / 1000.0);
-
-				focused_mountain = m;
-				redraw();
-			}
+			k = find_mountain(Fl::event_x()-x(), Fl::event_y()-y());
+			if (!k || !known_hills->contains(k->m))
+				set_focus(k);
 			return 1;
 		case FL_FOCUS:
 			return 1;
@@ -717,7 +1896,8 @@ GipfelWidget::handle(int event) {
 
 int
 GipfelWidget::export_hills(const char *file, FILE *fp) {
-	Hills export_hills, *mnts;
+	Sites export_sites;
+	Hills *mnts;
 
 	if (!have_gipfel_info) {
 		fprintf(stderr, "No gipfel info available for %s.\n", img_file);
@@ -725,15 +1905,18 @@ GipfelWidget::export_hills(const char *file, FILE *fp) {
 	}
 
 	if (file) {
-		if (export_hills.load(file) != 0)
+		if (export_sites.load(file) != 0)
 			return 1;
 
-		for (int i = 0; i < export_hills.get_num(); i++)
-			export_hills.get(i)->flags |= Hill::EXPORT;
-
-		pan->add_hills(&export_hills);  
+		for (int i = 0; i < export_sites.get_num(); i++)
+			export_sites.get(i)->flags |= Hill::EXPORT;
 	}
 
+	lock_pan();
+
+	if (file)
+		pan->add_hills(&export_sites);  
+
 	fprintf(fp, "#\n# name\theight\tx\ty\tdistance\tflags\n#\n");
 
 	mnts = pan->get_visible_mountains();
@@ -751,11 +1934,13 @@ GipfelWidget::export_hills(const char *file, FILE *fp) {
 			continue;
 
 		fprintf(fp, "%s\t%d\t%d\t%d\t%d\n",
-			m->name, (int) rint(m->height), _x, _y,
+			m->site->name, (int) rint(m->site->height), _x, _y,
 			(int) rint(pan->get_real_distance(m)));
 	}
 
 	pan->remove_hills(Hill::EXPORT);
+	unlock_pan(WORK_UPDATE);
+	export_sites.clobber();
 	
 	return 0;
 }
@@ -769,6 +1954,7 @@ GipfelWidget::get_pixel(ScanImage::mode_t m,
 	if (img == NULL)
 		return 1;
 
+	// Only used without worker thread, so pan is not locked.
 	if (pan->get_coordinates(a_alph, a_nick, &px, &py) != 0)
 		return 1;
 
@@ -792,31 +1978,30 @@ GipfelWidget::get_distortion_profile_name(char *buf, int buflen) {
 	}
 }
 
-static Fl_Preferences dist_prefs(Fl_Preferences::USER,
-	"Johannes.HofmannATgmx.de", "gipfel/DistortionProfiles");
-
 int
 GipfelWidget::load_distortion_params(const char *prof_name) {
-	int ret = 0;
+	double k0, k1, x0;
+	int ret;
 
-	Fl_Preferences prof(dist_prefs, prof_name);
-	ret += prof.get("k0", pan->parms.k0, pan->parms.k0);
-	ret += prof.get("k1", pan->parms.k1, pan->parms.k1);
-	ret += prof.get("x0", pan->parms.x0, pan->parms.x0);
+	get_distortion_params(&k0, &k1, &x0);
+	ret = read_distortion_profile(prof_name, &k0, &k1, &x0);
+	set_distortion_params(k0, k1, x0);
 
-	return !ret;
+	return ret;
 }
 
 int
 GipfelWidget::save_distortion_params(const char *prof_name, int force) {
 	Fl_Preferences prof(dist_prefs, prof_name);
+	double k0, k1, x0;
 
 	if (!force && prof.entryExists("k0"))
 		return 1;
 
-	prof.set("k0", pan->parms.k0);
-	prof.set("k1", pan->parms.k1);
-	prof.set("x0", pan->parms.x0);
+	get_distortion_params(&k0, &k1, &x0);
+	prof.set("k0", k0);
+	prof.set("k1", k1);
+	prof.set("x0", x0);
 
 	return 0;
 }
@@ -8,60 +8,31 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
-extern "C" {
-#include "strsep.h"
-}
 #include "Hill.H"
 
-static double pi_d, deg2rad;
-
-Hill::Hill(const char *n, double p, double l, double h) {
-	name = strdup(n);
-	phi = p;
-	lam = l;
-	height = h;
+Hill::Hill(const Site *s) {
+	site = s;
 	alph = 0.0;
-	x = 0;
-	y = 0;
-	flags = 0;
-}
-
-Hill::Hill(const Hill& h) {
-	name = strdup(h.name);
-	phi = h.phi;
-	lam = h.lam;
-	height = h.height;
-	alph = h.alph;
-	dist = h.dist;
-	x = h.x;
-	y = h.y;
-	label_x = h.label_x;
-	label_y = h.label_y;
-	flags = h.flags;
-}
-
-Hill::Hill(double x_tmp, double y_tmp) {
-	name = NULL;
-	phi = 0.0;
-	lam = 0.0;
-	height = 0.0;
-	alph = 0.0;
-	x = x_tmp;
-	y = y_tmp;
-}
-
-Hill::~Hill() {
-	if (name)
-		free(name);
+	a_nick = 0.0;
+	dist = 0.0;
+	sin_dist = 0.0;
+	cos_dist = 1.0;
+	x = 0.0;
+	y = 0.0;
+	label_x = 0;
+	label_y = 0;
+	flags = s ? s->flags : 0;
 }
 
-Hills::Hills() {
+Hills::Hills(bool indexed, bool site_key) {
 	num = 0;
 	cap = 100;
 	m = (Hill **) malloc(cap * sizeof(Hill *));
-
-	pi_d = asin(1.0) * 2.0;
-	deg2rad = pi_d / 180.0;
+	index = NULL;
+	index_cap = 0;
+	by_site = site_key;
+	if (indexed)
+		index_grow();
 }
 
 Hills::Hills(const Hills *h) {
@@ -69,61 +40,89 @@ Hills::Hills(const Hills *h) {
 	cap = h->cap;
 	m = (Hill **) malloc(cap * sizeof(Hill *));
 	memcpy(m, h->m, cap * sizeof(Hill *));
+	index = NULL;
+	index_cap = 0;
+	by_site = h->by_site;
+	if (h->index) {
+		index_grow();
+		for (int i = 0; i < num; i++)
+			index_add(m[i]);
+	}
+}
 
-	pi_d = asin(1.0) * 2.0;
-	deg2rad = pi_d / 180.0;
+static inline unsigned long
+hash_key(const void *k) {
+	return ((unsigned long) k >> 4) * 2654435761UL;
 }
 
-int
-Hills::load(const char *file) {
-	FILE *fp;
-	char buf[4000];
-	char *vals[10];
-	char **ap, *bp;
-	double phi, lam, height;
-	Hill *m;
-	int n;
-
-	fp = fopen(file, "r");
-	if (!fp) {
-		perror("fopen");
-		return 1;
-	}
+// Double the size of the index. Open addressing with linear probing,
+// kept at most half full.
+void
+Hills::index_grow() {
+	Hill **old = index;
+	int old_cap = index_cap;
 
-	while (fgets(buf, sizeof(buf), fp)) {
-		bp = buf;
-		memset(vals, 0, sizeof(vals));
-		n = 0;
-		for (ap = vals; (*ap = strsep(&bp, ",")) != NULL;) {
-			n++;
-			if (++ap >= &vals[10])
-				break;
-		}
+	index_cap = index_cap ? index_cap * 2 : 64;
+	index = (Hill **) calloc(index_cap, sizeof(Hill *));
 
-		// standard format including name and description
-		if (n == 6 && vals[1] && vals [3] && vals[4] && vals[5]) {
-			phi = atof(vals[3]) * deg2rad;
-			lam = atof(vals[4]) * deg2rad;
-			height = atof(vals[5]);
+	for (int i = 0; i < old_cap; i++) {
+		unsigned long j;
 
-			m = new Hill(vals[1], phi, lam, height);
+		if (!old[i])
+			continue;
 
-			add(m);
-			// track point format
-		} else if (n == 3 && vals[0] && vals[1] && vals[2]) {
-			phi = atof(vals[0]) * deg2rad;
-			lam = atof(vals[1]) * deg2rad;
-			height = atof(vals[2]);
+		j = hash_key(key(old[i])) & (index_cap - 1);
+		while (index[j])
+			j = (j + 1) & (index_cap - 1);
+		index[j] = old[i];
+	}
 
-			m = new Hill("", phi, lam, height);
+	if (old)
+		free(old);
+}
 
-			add(m);
-		}
+void
+Hills::index_add(Hill *h) {
+	unsigned long i;
+
+	if (2 * num > index_cap)
+		index_grow();
+
+	i = hash_key(key(h)) & (index_cap - 1);
+	while (index[i]) {
+		if (key(index[i]) == key(h))
+			return;
+		i = (i + 1) & (index_cap - 1);
 	}
 
-	fclose(fp);
+	index[i] = h;
+}
 
-	return 0;
+// Remove h and move back entries that were displaced by it.
+void
+Hills::index_remove(const Hill *h) {
+	unsigned long i, j, k, mask = index_cap - 1;
+
+	i = hash_key(key(h)) & mask;
+	while (index[i] && key(index[i]) != key(h))
+		i = (i + 1) & mask;
+
+	if (!index[i])
+		return;
+
+	index[i] = NULL;
+
+	for (j = (i + 1) & mask; index[j]; j = (j + 1) & mask) {
+		k = hash_key(key(index[j])) & mask;
+
+		// leave entries whose home slot is cyclically in (i, j]
+		if (i < j ? (k > i && k <= j) : (k > i || k <= j))
+			continue;
+
+		index[i] = index[j];
+		index[j] = NULL;
+		i = j;
+	}
 }
 
 void Hills::mark_duplicates(double dist) {
@@ -141,10 +140,10 @@ void Hills::mark_duplicates(double dist) {
 
 			j = i + 1;
 			n = get(j);
-			while (n && fabs(n->phi - m->phi) <= dist) {
+			while (n && fabs(n->site->phi - m->site->phi) <= dist) {
 				if (! (n->flags & Hill::DUPLIC)) {
-					if (fabs(n->lam - m->lam) <= dist && 
-						fabs(n->height - m->height) <= 50.0 ) {
+					if (fabs(n->site->lam - m->site->lam) <= dist && 
+						fabs(n->site->height - m->site->height) <= 50.0 ) {
 						n->flags |= Hill::DUPLIC;
 					}
 				}
@@ -158,6 +157,8 @@ void Hills::mark_duplicates(double dist) {
 Hills::~Hills() {
 	if (m)
 		free(m);
+	if (index)
+		free(index);
 }
 
 void
@@ -168,6 +169,9 @@ Hills::add(Hill *m1) {
 	}
 
 	m[num++] = m1;
+
+	if (index)
+		index_add(m1);
 }
 
 void
@@ -199,9 +203,9 @@ comp_mountains_phi(const void *n1, const void *n2) {
 	Hill *m2 = *(Hill **)n2;
 
 	if (m1 && m2) {
-		if (m1->phi < m2->phi)
+		if (m1->site->phi < m2->site->phi)
 			return 1;
-		else if (m1->phi > m2->phi)
+		else if (m1->site->phi > m2->site->phi)
 			return -1;
 		else
 			return 0;
@@ -217,9 +221,9 @@ comp_mountains_name(const void *n1, const void *n2) {
 	int r;
 
 	if (m1 && m2) {
-		r = strcasecmp(m1->name, m2->name);
+		r = strcasecmp(m1->site->name, m2->site->name);
 		if (r == 0)
-			return (int) (m1->height - m2->height);
+			return (int) (m1->site->height - m2->site->height);
 		else
 			return r;
 	} else {
@@ -261,6 +265,23 @@ comp_mountains_x(const void *n1, const void *n2) {
     }
 }
 
+static int
+comp_mountains_height_dist(const void *n1, const void *n2) {
+	Hill *m1 = *(Hill **)n1;
+	Hill *m2 = *(Hill **)n2;
+
+	if (m1 && m2) {
+		if (m1->site->height / m1->dist < m2->site->height / m2->dist)
+			return 1;
+		else if (m1->site->height / m1->dist > m2->site->height / m2->dist)
+			return -1;
+		else
+			return 0;
+	} else {
+		return 0;
+	}
+}
+
 void
 Hills::sort(SortType t) {
 	int (*cmp)(const void *, const void *);
@@ -284,6 +305,9 @@ Hills::sort(SortType t) {
 		case SORT_X:
 			cmp = comp_mountains_x;
 			break;
+		case SORT_HEIGHT_DIST:
+			cmp = comp_mountains_height_dist;
+			break;
 		default:
 			fprintf(stderr, "ERROR: Unknown sort type %d\n", t);
 			return;
@@ -300,10 +324,25 @@ Hills::clear() {
 	}
 	cap = 0;
 	num = 0;
+
+	if (index)
+		memset(index, 0, index_cap * sizeof(Hill *));
 }
 
 int
 Hills::contains(const Hill *m) const {
+	if (index) {
+		unsigned long i = hash_key(key(m)) & (index_cap - 1);
+
+		while (index[i]) {
+			if (key(index[i]) == key(m))
+				return 1;
+			i = (i + 1) & (index_cap - 1);
+		}
+
+		return 0;
+	}
+
 	for  (int i = 0; i < get_num(); i++)
 		if (get(i) == m)
 			return 1;
@@ -313,25 +352,21 @@ Hills::contains(const Hill *m) const {
 
 void
 Hills::remove(const Hill *h) {
+	if (index) {
+		if (!contains(h))
+			return;
+		index_remove(h);
+	}
+
 	for (int i = 0; i < get_num(); i++) {
 		if (get(i) == h) {
 			memmove(&m[i], &m[i+1], (get_num() - i - 1) * sizeof(Hill*));
 			num--;
+			i--;
 		}
 	}
 }
 
-void
-Hills::clobber() {
-	int i;
-
-	for (i = 0; i < get_num(); i++)
-		if (get(i))
-			delete(get(i));
-
-	clear();
-}
-
 Hill *
 Hills::get(int n) const {
 	if (n < 0 || n >= num)
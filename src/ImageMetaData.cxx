@@ -13,6 +13,7 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -60,13 +61,49 @@ ImageMetaData::clear() {
 	_focal_length_35mm = NAN;
 	_scale = NAN;
 	_projection_type = 0;
+	_image_width = 0;
+	_image_height = 0;
+}
+
+static pthread_mutex_t xmp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+xmp_lock_fct(void *data, bool lock) {
+	if (lock)
+		pthread_mutex_lock((pthread_mutex_t *) data);
+	else
+		pthread_mutex_unlock((pthread_mutex_t *) data);
+}
+
+// Must be called before images are loaded or saved from several threads,
+// as the XMP toolkit of Exiv2 is not thread safe otherwise.
+void
+ImageMetaData::init() {
+	static bool initialized = false;
+
+	if (!initialized) {
+		Exiv2::XmpParser::initialize(xmp_lock_fct, &xmp_lock);
+		initialized = true;
+	}
 }
 
 int
 ImageMetaData::load_image(char *name) {
+	Exiv2::Image::AutoPtr image;
+
 	clear();
-	load_image_jpgcom(name);
-	load_image_exif(name); // fill missing values from exif data
+
+	// open and parse the file only once for both
+	try {
+		image = Exiv2::ImageFactory::open(name);
+		image->readMetadata();
+	} catch (const Exiv2::Error &error) {
+		fprintf(stderr, "Error reading metadata\n");
+		return 0;
+	}
+
+	load_image_jpgcom(image.get());
+	load_image_exif(name, image.get()); // fill missing values from exif data
 	return 0;
 }
 
@@ -100,17 +137,7 @@ exifSetCoordinate(double *destVal, Exiv2::ExifData *exifData, const char *name)
 }
 
 int
-ImageMetaData::load_image_exif(char *name) {
-	Exiv2::Image::AutoPtr image;
-
-	try {
-		image = Exiv2::ImageFactory::open(name);
-		image->readMetadata();
-	} catch (const Exiv2::Error &error) {
-		fprintf(stderr, "Error reading metadata\n");
-		return 1;
-	}
-
+ImageMetaData::load_image_exif(char *name, Exiv2::Image *image) {
     Exiv2::ExifData &exifData = image->exifData();
     if (exifData.empty()) {
 		fprintf(stderr, "%s: No Exif data found in the file", name);
@@ -165,19 +192,13 @@ static const char *gipfel_format_prnt = GIPFEL_FORMAT;
 #undef GIPFEL_FORMAT
 
 int
-ImageMetaData::load_image_jpgcom(char *name) {
+ImageMetaData::load_image_jpgcom(Exiv2::Image *image) {
     double lo, la, he, dir, ni, ti, fr, k0, k1, x0 = 0.0;
     int pt = 0;
     int n, ret = 1;
-	Exiv2::Image::AutoPtr image;
 
-	try {
-		image = Exiv2::ImageFactory::open(name);
-		image->readMetadata();
-	} catch (const Exiv2::Error &error) {
-		fprintf(stderr, "Error reading metadata\n");
-		return 1;
-	}
+	_image_width = image->pixelWidth();
+	_image_height = image->pixelHeight();
 
     const char *com = image->comment().c_str();
 
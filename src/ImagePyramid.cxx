@@ -0,0 +1,392 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <algorithm>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+#include <FL/fl_draw.H>
+
+#include "ImagePyramid.H"
+
+#define MIN_LEVEL_SIZE 256
+#define PREVIEW_LEVEL  3
+
+ImagePyramid::ImagePyramid(void (*cb)(void *), void *arg) {
+	levels = NULL;
+	num_levels = 0;
+	d = 0;
+	img = NULL;
+	cancel = 0;
+	thread_running = false;
+	ready_cb = cb;
+	ready_arg = arg;
+	pthread_mutex_init(&lock, NULL);
+}
+
+ImagePyramid::ImagePyramid(Fl_Image *i, void (*cb)(void *), void *arg) {
+	levels = NULL;
+	num_levels = 0;
+	d = 0;
+	img = NULL;
+	cancel = 0;
+	thread_running = false;
+	ready_cb = cb;
+	ready_arg = arg;
+	pthread_mutex_init(&lock, NULL);
+
+	set_image(i);
+}
+
+ImagePyramid::~ImagePyramid() {
+	if (thread_running) {
+		pthread_mutex_lock(&lock);
+		cancel = 1;
+		pthread_mutex_unlock(&lock);
+		pthread_join(thread, NULL);
+	}
+
+	for (int i = 1; i < num_levels; i++)
+		if (levels[i].data)
+			free(levels[i].data);
+
+	if (levels)
+		free(levels);
+
+	pthread_mutex_destroy(&lock);
+}
+
+// Set up empty levels for a w x h image with depth d, keeping the
+// levels if they match. Must not be called once started.
+int
+ImagePyramid::init(int w, int h, int depth) {
+	if (w <= 0 || h <= 0 || depth < 1 || depth > 4)
+		return 1;
+
+	if (levels && levels[0].w == w && levels[0].h == h && d == depth)
+		return 0;
+
+	for (int i = 1; i < num_levels; i++)
+		if (levels[i].data)
+			free(levels[i].data);
+	if (levels)
+		free(levels);
+
+	d = depth;
+	num_levels = 1;
+	for (int lw = w, lh = h; lw > MIN_LEVEL_SIZE || lh > MIN_LEVEL_SIZE;
+		lw = std::max(lw / 2, 1), lh = std::max(lh / 2, 1))
+		num_levels++;
+
+	levels = (level_t *) calloc(num_levels, sizeof(level_t));
+	levels[0].w = w;
+	levels[0].h = h;
+	for (int i = 1; i < num_levels; i++) {
+		levels[i].w = std::max(levels[i - 1].w / 2, 1);
+		levels[i].h = std::max(levels[i - 1].h / 2, 1);
+	}
+
+	return 0;
+}
+
+// Use img as level 0. A preview is kept if it has the same size.
+int
+ImagePyramid::set_image(Fl_Image *i) {
+	// Same restriction as ScanImage::get_pixel().
+	if (thread_running || i->count() != 1 ||
+		init(i->w(), i->h(), i->d()) != 0)
+		return 1;
+
+	img = i;
+
+	pthread_mutex_lock(&lock);
+	levels[0].data = (unsigned char *) img->data()[0];
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+struct preview_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf jb;
+};
+
+static void
+preview_error_exit(j_common_ptr cinfo) {
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(((struct preview_error *) cinfo->err)->jb, 1);
+}
+
+// Decode a reduced version of the JPEG file into one of the coarser
+// levels. libjpeg scales while decoding, which is much faster than a
+// full decode.
+int
+ImagePyramid::load_jpeg_preview(const char *file) {
+	struct jpeg_decompress_struct cinfo;
+	struct preview_error jerr;
+	unsigned char * volatile data = NULL;
+	unsigned char * volatile row = NULL;
+	int n;
+	FILE *fp;
+
+	if (thread_running)
+		return 1;
+
+	if ((fp = fopen(file, "rb")) == NULL) {
+		perror("fopen");
+		return 1;
+	}
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = preview_error_exit;
+
+	if (setjmp(jerr.jb)) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(fp);
+		if (data)
+			free(data);
+		if (row)
+			free(row);
+		return 1;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, fp);
+	jpeg_read_header(&cinfo, TRUE);
+
+	if (cinfo.jpeg_color_space == JCS_GRAYSCALE)
+		cinfo.out_color_space = JCS_GRAYSCALE;
+	else
+		cinfo.out_color_space = JCS_RGB;
+
+	if (init(cinfo.image_width, cinfo.image_height,
+		cinfo.out_color_space == JCS_GRAYSCALE ? 1 : 3) != 0) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(fp);
+		return 1;
+	}
+
+	n = std::min(num_levels - 1, PREVIEW_LEVEL);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 1 << n;
+	jpeg_start_decompress(&cinfo);
+
+	// libjpeg rounds the scaled size up, the levels round down
+	data = (unsigned char *) malloc((size_t) levels[n].w * levels[n].h * d);
+	row = (unsigned char *) malloc(cinfo.output_width * cinfo.output_components);
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		int y = cinfo.output_scanline;
+		JSAMPROW r = row;
+
+		jpeg_read_scanlines(&cinfo, &r, 1);
+		if (y < levels[n].h)
+			memcpy(data + (size_t) y * levels[n].w * d, row,
+				std::min((int) cinfo.output_width, levels[n].w) * d);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(fp);
+	free(row);
+
+	pthread_mutex_lock(&lock);
+	if (levels[n].data)
+		free(levels[n].data);
+	levels[n].data = data;
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+// Start computing the levels once level 0 is there, unless already
+// done.
+int
+ImagePyramid::start() {
+	if (thread_running || num_levels <= 1 || !img)
+		return 0;
+
+	if (pthread_create(&thread, NULL, build_main, this) != 0) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	thread_running = true;
+
+	return 0;
+}
+
+int
+ImagePyramid::level_w(int n) const {
+	return n >= 0 && n < num_levels ? levels[n].w : 0;
+}
+
+int
+ImagePyramid::level_h(int n) const {
+	return n >= 0 && n < num_levels ? levels[n].h : 0;
+}
+
+int
+ImagePyramid::cancelled() {
+	int c;
+
+	pthread_mutex_lock(&lock);
+	c = cancel;
+	pthread_mutex_unlock(&lock);
+
+	return c;
+}
+
+// Average 2 x 2 blocks of level n - 1. Return 1 if cancelled.
+// Averaging 2 x 2 blocks twice is the same as averaging 4 x 4 blocks,
+// so building from the previous level gives the box filter of level 0
+// at a fraction of the cost. Only the rounding to 8 bits, at most half
+// a step per level, and the repeated last row or column of odd sizes
+// add up.
+int
+ImagePyramid::build_level(int n) {
+	const level_t *src = &levels[n - 1];
+	level_t *dst = &levels[n];
+	int ld = src->w * d;
+	unsigned char *data;
+
+	data = (unsigned char *) malloc((size_t) dst->w * dst->h * d);
+
+	for (int y = 0; y < dst->h; y++) {
+		const unsigned char *r0, *r1;
+		unsigned char *out = data + (size_t) y * dst->w * d;
+
+		if (cancelled()) {
+			free(data);
+			return 1;
+		}
+
+		r0 = src->data + (size_t) std::min(2 * y, src->h - 1) * ld;
+		r1 = src->data + (size_t) std::min(2 * y + 1, src->h - 1) * ld;
+
+		for (int x = 0; x < dst->w; x++) {
+			int x0 = std::min(2 * x, src->w - 1) * d;
+			int x1 = std::min(2 * x + 1, src->w - 1) * d;
+
+			for (int c = 0; c < d; c++)
+				*out++ = (r0[x0 + c] + r0[x1 + c] +
+					r1[x0 + c] + r1[x1 + c] + 2) / 4;
+		}
+	}
+
+	pthread_mutex_lock(&lock);
+	dst->data = data;
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+void *
+ImagePyramid::build_main(void *p) {
+	ImagePyramid *ip = (ImagePyramid *) p;
+
+	// Levels are only written by this thread once it runs.
+	for (int n = 1; n < ip->num_levels; n++) {
+		if (ip->levels[n].data) // preview
+			continue;
+
+		if (ip->build_level(n) != 0)
+			break;
+
+		if (ip->ready_cb)
+			ip->ready_cb(ip->ready_arg);
+	}
+
+	return NULL;
+}
+
+// Return the ready level closest to n, preferring finer ones, or -1.
+int
+ImagePyramid::find_ready(int n) {
+	int r = -1;
+
+	pthread_mutex_lock(&lock);
+
+	for (int i = n; i >= 0 && r < 0; i--)
+		if (levels[i].data)
+			r = i;
+
+	for (int i = n + 1; i < num_levels && r < 0; i++)
+		if (levels[i].data)
+			r = i;
+
+	pthread_mutex_unlock(&lock);
+
+	return r;
+}
+
+// fl_draw_image() callback, scales src by 2^-down or 2^up.
+void
+ImagePyramid::scan_line(void *p, int x, int y, int w, unsigned char *buf) {
+	const scan_t *s = (const scan_t *) p;
+	int sy = std::min(((s->sy + y) << s->down) >> s->up, s->src->h - 1);
+	const unsigned char *row = s->src->data + (size_t) sy * s->src->w * s->d;
+
+	for (int i = 0; i < w; i++) {
+		int sx = std::min(((s->sx + x + i) << s->down) >> s->up,
+			s->src->w - 1);
+
+		for (int c = 0; c < s->d; c++)
+			*buf++ = row[sx * s->d + c];
+	}
+}
+
+void
+ImagePyramid::draw(int n, int X, int Y, int W, int H, int sx, int sy) {
+	int r;
+
+	if (n < 0 || n >= num_levels)
+		return;
+
+	// clip to the level
+	if (sx < 0) {
+		X -= sx;
+		W += sx;
+		sx = 0;
+	}
+	if (sy < 0) {
+		Y -= sy;
+		H += sy;
+		sy = 0;
+	}
+	W = std::min(W, levels[n].w - sx);
+	H = std::min(H, levels[n].h - sy);
+
+	if (W <= 0 || H <= 0)
+		return;
+
+	r = find_ready(n);
+
+	if (r < 0) {
+		fl_color(FL_GRAY);
+		fl_rectf(X, Y, W, H);
+	} else if (r == n) {
+		fl_draw_image(levels[n].data + ((size_t) sy * levels[n].w + sx) * d,
+			X, Y, W, H, d, levels[n].w * d);
+	} else {
+		scan_t s;
+
+		s.src = &levels[r];
+		s.d = d;
+		s.down = std::max(n - r, 0);
+		s.up = std::max(r - n, 0);
+		s.sx = sx;
+		s.sy = sy;
+
+		fl_draw_image(scan_line, &s, X, Y, W, H, d);
+	}
+}
@@ -7,41 +7,138 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 extern "C" {
 #include <jpeglib.h>
 }
 
+#include "Parallel.H"
 #include "JPEGOutputImage.H"
 
+// In parallel mode, horizontal bands are encoded as separate JPEGs
+// with a restart marker after each MCU row. A restart resets the DC
+// predictors, so the entropy coded data of the bands, joined by the
+// restart markers a single encoder would have put there, is the scan
+// of the whole image. Headers are taken from the first band, with the
+// image height fixed up.
+
 JPEGOutputImage::JPEGOutputImage(const char *f, int q) : OutputImage() {
 	file = strdup(f);
 	fp = NULL;
 	row = NULL;
 	quality = q;
+	parallel = false;
+	bands = NULL;
+	num_bands = 0;
 }
 
 JPEGOutputImage::~JPEGOutputImage() {
-	if (row)
+	if (row && !parallel)
 		free(row);
+	free_bands();
+	if (fp)
+		fclose(fp);
 	if (file)
 		free(file);
 }
 
+void
+JPEGOutputImage::set_parallel(bool p) {
+	if (!row)
+		parallel = p;
+}
+
+void
+JPEGOutputImage::free_bands() {
+	for (int i = 0; i < num_bands; i++) {
+		free(bands[i].rows);
+		if (bands[i].jpeg)
+			free(bands[i].jpeg);
+	}
+
+	if (bands)
+		free(bands);
+	bands = NULL;
+	num_bands = 0;
+	if (parallel)
+		row = NULL;
+}
+
+void
+JPEGOutputImage::setup(struct jpeg_compress_struct *c, int h) {
+	c->image_width = W;
+	c->image_height = h;
+	c->input_components = 3;          /* # of color components per pixel */
+	c->in_color_space = JCS_RGB;
+
+	jpeg_set_defaults(c);
+	jpeg_set_quality(c, quality, TRUE);
+
+	if (parallel)
+		c->restart_in_rows = 1;
+}
+
 int
 JPEGOutputImage::init_internal() {
-	if (row)
+	if (parallel) {
+		free_bands();
+	} else if (row) {
 		free(row);
+	}
 	row = NULL;
 
+	if (fp)
+		fclose(fp);
+	fp = NULL;
+
+	if (parallel) {
+		int mcu_rows = 0, total_bands;
+
+		// same MCU size in all bands
+		cinfo.err = jpeg_std_error(&jerr);
+		jpeg_create_compress(&cinfo);
+		setup(&cinfo, H);
+		for (int i = 0; i < cinfo.num_components; i++)
+			mcu_rows = std::max(mcu_rows,
+				cinfo.comp_info[i].v_samp_factor * DCTSIZE);
+		jpeg_destroy_compress(&cinfo);
+
+		// restart markers are numbered modulo 8
+		band_rows = 8 * mcu_rows;
+		total_bands = (H + band_rows - 1) / band_rows;
+		num_bands = std::max(std::min(Parallel::num_cpus(), total_bands), 1);
+		bands = (band_t *) calloc(num_bands, sizeof(band_t));
+
+		for (int i = 0; i < num_bands; i++) {
+			bands[i].rows = (unsigned char *) malloc((size_t) band_rows * W * 3);
+			if (!bands[i].rows) {
+				perror("malloc");
+				free_bands();
+				return 1;
+			}
+		}
+
+		cur_band = 0;
+		cur_row = 0;
+		bands_written = 0;
+		row = bands[0].rows;
+		memset(row, 0, 3 * W);
+
+		if ((fp = fopen(file, "wb")) == NULL) {
+			fprintf(stderr, "can't open %s\n", file);
+			free_bands();
+			return 1;
+		}
+
+		return 0;
+	}
+
 	row = (unsigned char*) calloc(3 * W, sizeof(char));
 	if (!row) {
 		perror("calloc");
 		return 1;
 	}
 
-	if (fp)
-		fclose(fp);
-
 	if ((fp = fopen(file, "wb")) == NULL) {
 		fprintf(stderr, "can't open %s\n", file);
 		return 1;
@@ -50,13 +147,7 @@ JPEGOutputImage::init_internal() {
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
 	jpeg_stdio_dest(&cinfo, fp);
-	cinfo.image_width = W;
-	cinfo.image_height = H;
-	cinfo.input_components = 3;          /* # of color components per pixel */
-	cinfo.in_color_space = JCS_RGB;
-
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
+	setup(&cinfo, H);
 
 	jpeg_start_compress(&cinfo, TRUE);
 
@@ -65,6 +156,9 @@ JPEGOutputImage::init_internal() {
 
 int
 JPEGOutputImage::set_pixel_internal(int x, int r, int g, int b) {
+	if (!row)
+		return 1;
+
 	row[x*3+0] = (unsigned char) (r / 255);
 	row[x*3+1] = (unsigned char) (g / 255);
 	row[x*3+2] = (unsigned char) (b / 255);
@@ -76,14 +170,246 @@ int
 JPEGOutputImage::next_line_internal() {
 	JSAMPROW row_pointer[1];
 
+	if (parallel)
+		return end_row();
+
 	row_pointer[0] = row;
 	jpeg_write_scanlines(&cinfo, row_pointer, 1);
 	memset(row, 0, sizeof(char) * 3 * W);
 	return 0;
 }
 
+int
+JPEGOutputImage::write_row_internal(const void *r, row_format_t fmt) {
+	JSAMPROW row_pointer[1];
+
+	if (parallel) {
+		if (!row)
+			return 1;
+
+		convert_row(r, fmt, row, 3, W);
+		line++;
+
+		return end_row();
+	}
+
+	if (fmt == RGB_8) {
+		row_pointer[0] = (JSAMPROW) r; // libjpeg does not modify it
+	} else {
+		convert_row(r, fmt, row, 3, W);
+		row_pointer[0] = row;
+	}
+
+	jpeg_write_scanlines(&cinfo, row_pointer, 1);
+	line++;
+
+	return 0;
+}
+
+// Move on to the next row once line is complete, encoding full bands.
+int
+JPEGOutputImage::end_row() {
+	if (!row)
+		return 1;
+
+	if (++cur_row == band_rows || line >= H) {
+		bands[cur_band].num_rows = cur_row;
+		cur_band++;
+		cur_row = 0;
+
+		if ((cur_band == num_bands || line >= H) && flush() != 0) {
+			free_bands();
+			return 1;
+		}
+	}
+
+	row = bands[cur_band].rows + (size_t) cur_row * W * 3;
+	memset(row, 0, 3 * W);
+
+	return 0;
+}
+
+typedef struct {
+	struct jpeg_destination_mgr pub;
+	unsigned char **buf;
+	unsigned long *len, *cap;
+} mem_dest_t;
+
+static void
+mem_init(j_compress_ptr c) {
+	mem_dest_t *d = (mem_dest_t *) c->dest;
+
+	if (*d->cap == 0) {
+		*d->cap = 1 << 16;
+		*d->buf = (unsigned char *) malloc(*d->cap);
+	}
+
+	d->pub.next_output_byte = *d->buf;
+	d->pub.free_in_buffer = *d->cap;
+}
+
+static boolean
+mem_empty(j_compress_ptr c) {
+	mem_dest_t *d = (mem_dest_t *) c->dest;
+	unsigned long old_cap = *d->cap;
+
+	*d->cap *= 2;
+	*d->buf = (unsigned char *) realloc(*d->buf, *d->cap);
+	d->pub.next_output_byte = *d->buf + old_cap;
+	d->pub.free_in_buffer = *d->cap - old_cap;
+
+	return TRUE;
+}
+
+static void
+mem_term(j_compress_ptr c) {
+	mem_dest_t *d = (mem_dest_t *) c->dest;
+
+	*d->len = *d->cap - d->pub.free_in_buffer;
+}
+
+// Compress into *buf of *cap bytes, which is malloc()ed if *cap is 0
+// and grown as needed. It holds *len bytes once done. Unlike
+// jpeg_mem_dest() of newer libjpegs, the buffer can be reused.
+void
+JPEGOutputImage::mem_dest(struct jpeg_compress_struct *c,
+	unsigned char **buf, unsigned long *len, unsigned long *cap) {
+	mem_dest_t *d;
+
+	d = (mem_dest_t *) (*c->mem->alloc_small)((j_common_ptr) c,
+		JPOOL_PERMANENT, sizeof(mem_dest_t));
+	d->pub.init_destination = mem_init;
+	d->pub.empty_output_buffer = mem_empty;
+	d->pub.term_destination = mem_term;
+	d->buf = buf;
+	d->len = len;
+	d->cap = cap;
+	c->dest = &d->pub;
+}
+
+void
+JPEGOutputImage::encode_job(int n, void *data) {
+	JPEGOutputImage *jo = (JPEGOutputImage *) data;
+	band_t *b = &jo->bands[n];
+	struct jpeg_compress_struct c;
+	struct jpeg_error_mgr e;
+
+	c.err = jpeg_std_error(&e);
+	jpeg_create_compress(&c);
+
+	mem_dest(&c, &b->jpeg, &b->len, &b->cap);
+
+	jo->setup(&c, b->num_rows);
+	jpeg_start_compress(&c, TRUE);
+
+	for (int y = 0; y < b->num_rows; y++) {
+		JSAMPROW r = b->rows + (size_t) y * jo->W * 3;
+		jpeg_write_scanlines(&c, &r, 1);
+	}
+
+	jpeg_finish_compress(&c);
+	jpeg_destroy_compress(&c);
+}
+
+// Offset of the entropy coded data in buf, i.e. the end of the SOS
+// header. The height in SOF is set to h.
+static unsigned long
+find_scan(unsigned char *buf, unsigned long len, int h) {
+	unsigned long pos = 2; // SOI
+
+	while (pos + 4 <= len && buf[pos] == 0xff) {
+		int marker = buf[pos + 1];
+		unsigned long seg = (buf[pos + 2] << 8) | buf[pos + 3];
+
+		if (marker >= 0xc0 && marker <= 0xc2) { // SOF
+			buf[pos + 5] = (h >> 8) & 0xff;
+			buf[pos + 6] = h & 0xff;
+		} else if (marker == 0xda) { // SOS
+			return pos + 2 + seg;
+		}
+
+		pos += 2 + seg;
+	}
+
+	return 0;
+}
+
+// Encode the bands of the batch and append them to the file.
+int
+JPEGOutputImage::flush() {
+	int n = cur_band;
+
+	cur_band = 0;
+
+	Parallel::run(n, encode_job, this);
+
+	for (int i = 0; i < n; i++) {
+		band_t *b = &bands[i];
+		unsigned long start = find_scan(b->jpeg, b->len, H);
+		int ret = 0;
+
+		if (start == 0 || b->len < start + 2) {
+			fprintf(stderr, "%s: invalid band\n", file);
+			return 1;
+		}
+
+		if (bands_written == 0) {
+			ret = fwrite(b->jpeg, start, 1, fp) != 1;
+		} else {
+			// A band has 8 MCU rows, so it contains RST0 to RST6 and
+			// RST7 follows its last row.
+			unsigned char m[2] = {0xff, 0xd7};
+
+			ret = fwrite(m, 2, 1, fp) != 1;
+		}
+
+		// without EOI
+		if (ret == 0 && b->len > start + 2)
+			ret = fwrite(b->jpeg + start, b->len - start - 2, 1, fp) != 1;
+
+		if (ret != 0) {
+			perror("fwrite");
+			return 1;
+		}
+
+		bands_written++;
+	}
+
+	if (line >= H) {
+		unsigned char eoi[2] = {0xff, 0xd9};
+
+		if (fwrite(eoi, 2, 1, fp) != 1) {
+			perror("fwrite");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 int
 JPEGOutputImage::done_internal() {
+	if (parallel) {
+		int ret = 0;
+
+		// rows of a band not completed by next_line()
+		if (row && cur_row > 0) {
+			bands[cur_band].num_rows = cur_row;
+			cur_band++;
+		}
+
+		if (row && cur_band > 0)
+			ret = flush();
+
+		if (fp && fclose(fp) != 0)
+			ret = 1;
+		fp = NULL;
+
+		free_bands();
+
+		return ret;
+	}
+
 	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
 
@@ -6,6 +6,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "OutputImage.H"
 
@@ -47,6 +48,124 @@ OutputImage::next_line() {
 		return next_line_internal();
 }
 
+int
+OutputImage::write_row(const void *row, row_format_t fmt) {
+	if (!initialized || line >= H)
+		return 1;
+	else
+		return write_row_internal(row, fmt);
+}
+
+// Fallback for writers without a bulk path.
+int
+OutputImage::write_row_internal(const void *row, row_format_t fmt) {
+	unsigned short *px = (unsigned short *) malloc(W * 4 * sizeof(unsigned short));
+
+	convert_row(row, fmt, px, 4, W);
+	for (int x = 0; x < W; x++)
+		if (px[x * 4 + 3])
+			set_pixel_internal(x, px[x * 4 + 0], px[x * 4 + 1], px[x * 4 + 2]);
+
+	free(px);
+
+	return next_line();
+}
+
+static inline unsigned char
+div255(unsigned int v) {
+	return (v + 1 + (v >> 8)) >> 8; // v / 255 for v <= 65025
+}
+
+// Convert n pixels to 8 bit with 3 or 4 channels, alpha 255 if missing.
+// The loops are simple enough for the compiler to vectorize.
+void
+OutputImage::convert_row(const void *row, row_format_t fmt,
+	unsigned char *out, int channels, int n) {
+	const unsigned char *r8 = (const unsigned char *) row;
+	const unsigned short *r16 = (const unsigned short *) row;
+
+	switch (fmt) {
+		case RGB_8:
+			if (channels == 3) {
+				memcpy(out, r8, n * 3);
+				return;
+			}
+
+			for (int i = 0; i < n; i++) {
+				out[i * 4 + 0] = r8[i * 3 + 0];
+				out[i * 4 + 1] = r8[i * 3 + 1];
+				out[i * 4 + 2] = r8[i * 3 + 2];
+				out[i * 4 + 3] = 255;
+			}
+			break;
+		case RGBA_8:
+			if (channels == 4) {
+				memcpy(out, r8, n * 4);
+				return;
+			}
+
+			for (int i = 0; i < n; i++) {
+				out[i * 3 + 0] = r8[i * 4 + 0];
+				out[i * 3 + 1] = r8[i * 4 + 1];
+				out[i * 3 + 2] = r8[i * 4 + 2];
+			}
+			break;
+		case RGB_16:
+			for (int i = 0; i < n; i++) {
+				out[i * channels + 0] = div255(r16[i * 3 + 0]);
+				out[i * channels + 1] = div255(r16[i * 3 + 1]);
+				out[i * channels + 2] = div255(r16[i * 3 + 2]);
+				if (channels == 4)
+					out[i * 4 + 3] = 255;
+			}
+			break;
+		case RGBA_16:
+			if (channels == 4) {
+				for (int i = 0; i < n * 4; i++)
+					out[i] = div255(r16[i]);
+				return;
+			}
+
+			for (int i = 0; i < n; i++) {
+				out[i * 3 + 0] = div255(r16[i * 4 + 0]);
+				out[i * 3 + 1] = div255(r16[i * 4 + 1]);
+				out[i * 3 + 2] = div255(r16[i * 4 + 2]);
+			}
+			break;
+	}
+}
+
+// Convert n pixels to the 0..65025 scale with 3 or 4 channels, alpha
+// 65025 if missing.
+void
+OutputImage::convert_row(const void *row, row_format_t fmt,
+	unsigned short *out, int channels, int n) {
+	const unsigned char *r8 = (const unsigned char *) row;
+	const unsigned short *r16 = (const unsigned short *) row;
+	int in_channels = (fmt == RGB_8 || fmt == RGB_16) ? 3 : 4;
+
+	if (fmt == RGB_8 || fmt == RGBA_8) {
+		for (int i = 0; i < n; i++) {
+			out[i * channels + 0] = r8[i * in_channels + 0] * 255;
+			out[i * channels + 1] = r8[i * in_channels + 1] * 255;
+			out[i * channels + 2] = r8[i * in_channels + 2] * 255;
+			if (channels == 4)
+				out[i * 4 + 3] = in_channels == 4 ?
+					r8[i * 4 + 3] * 255 : 65025;
+		}
+	} else if (channels == in_channels) {
+		memcpy(out, r16, n * channels * sizeof(unsigned short));
+	} else {
+		for (int i = 0; i < n; i++) {
+			out[i * channels + 0] = r16[i * in_channels + 0];
+			out[i * channels + 1] = r16[i * in_channels + 1];
+			out[i * channels + 2] = r16[i * in_channels + 2];
+			if (channels == 4)
+				out[i * 4 + 3] = 65025;
+		}
+	}
+}
+
 int
 OutputImage::done() {
 	if (!initialized) {
@@ -14,11 +14,23 @@
 #include "ProjectionCylindrical.H"
 
 #define EARTH_RADIUS 6371000.785
+#define MAX_REPROJECTION_ERROR 20.0
+#define CANCEL_CHECK_INTERVAL 1024
 
 Panorama::Panorama() {
+	dirty = ANGLES;
+	cancel_cb = NULL;
+	cancel_arg = NULL;
+	sites = NULL;
+	blocks = NULL;
+	num_blocks = 0;
 	mountains = new Hills();
+	ratio_mountains = new Hills();
+	num_ratio_close = 0;
 	close_mountains = new Hills();
-	visible_mountains = new Hills();
+	visible_mountains = new Hills(true);
+	visible_from[0] = visible_to[0] = 0;
+	visible_from[1] = visible_to[1] = 0;
 	height_dist_ratio = 0.07;
 	hide_value = 1.2;
 	pi_d = asin(1.0) * 2.0;
@@ -39,37 +51,87 @@ Panorama::Panorama() {
 }
 
 Panorama::~Panorama() {
-	visible_mountains->clear();
-	mountains->clobber();
+	for (int i = 0; i < num_blocks; i++)
+		delete [] blocks[i].hills;
+	if (blocks)
+		free(blocks);
+	if (sites) {
+		sites->clobber();
+		delete sites;
+	}
 	delete visible_mountains;
+	delete close_mountains;
+	delete ratio_mountains;
 	delete mountains;
+	if (proj)
+		delete proj;
+	if (view_name)
+		free(view_name);
 }
 
 int
 Panorama::load_data(const char *name) {
-	if (mountains->load(name) != 0) {
+	Sites *s = new Sites();
+
+	if (s->load(name) != 0) {
 		fprintf(stderr, "Could not load datafile %s\n", name);
+		delete s;
 		return 1;
 	}
 
-	mountains->mark_duplicates(0.00001);
-	update_angles();
+	add_sites(s);
 
 	return 0;
 }
 
+// Add a Hill for each of s and take ownership of the sites, e.g. of a
+// catalog loaded by another thread.
 void
-Panorama::add_hills(Hills *h) {
-	mountains->add(h);
+Panorama::add_sites(Sites *s) {
+	add_hills(s);
+
+	if (sites) {
+		sites->add(s);
+		delete s;
+	} else {
+		sites = s;
+	}
+}
+
+// Add a Hill for each of s. The sites are only referenced, they must
+// stay around as long as the Panorama. If added is given, the new
+// hills are appended to it in the order of s.
+void
+Panorama::add_hills(const Sites *s, Hills *added) {
+	Hill *h;
+
+	if (s->get_num() == 0)
+		return;
+
+	h = new Hill[s->get_num()];
+	for (int i = 0; i < s->get_num(); i++) {
+		h[i] = Hill(s->get(i));
+		mountains->add(&h[i]);
+		if (added)
+			added->add(&h[i]);
+	}
+
+	blocks = (block_t *) realloc(blocks, (num_blocks + 1) * sizeof(block_t));
+	blocks[num_blocks].hills = h;
+	blocks[num_blocks].num = s->get_num();
+	num_blocks++;
 
 	mountains->mark_duplicates(0.00001);
-	update_angles();
+	dirty |= ANGLES;
 }
 
+// Remove all hills with one of flags set. They must not be used
+// afterwards.
 void
 Panorama::remove_hills(int flags) {
 	Hills *h_new = new Hills();
 	Hill *m;
+	int n = 0;
 
 	for (int i = 0; i < mountains->get_num(); i++) {
 		m = mountains->get(i);
@@ -79,6 +141,32 @@ Panorama::remove_hills(int flags) {
 
 	delete mountains;
 	mountains = h_new;
+
+	// Derived lists would point to deleted hills until the next
+	// update().
+	ratio_mountains->clear();
+	close_mountains->clear();
+	visible_mountains->clear();
+	num_ratio_close = 0;
+	visible_from[0] = visible_to[0] = 0;
+	visible_from[1] = visible_to[1] = 0;
+
+	for (int i = 0; i < num_blocks; i++) {
+		int removed = 0;
+
+		for (int j = 0; j < blocks[i].num; j++)
+			if (blocks[i].hills[j].flags & flags)
+				removed++;
+
+		if (removed == blocks[i].num)
+			delete [] blocks[i].hills;
+		else
+			blocks[n++] = blocks[i];
+	}
+
+	num_blocks = n;
+
+	dirty |= ANGLES;
 }
 
 int
@@ -98,16 +186,16 @@ Panorama::set_viewpoint(const Hill *m) {
 	if (m == NULL)
 		return;
 
-	view_phi = m->phi;
-	view_lam = m->lam;
-	view_height = m->height;
+	view_phi = m->site->phi;
+	view_lam = m->site->lam;
+	view_height = m->site->height;
 
 	if (view_name)
 		free(view_name);
 
-	view_name = strdup(m->name);
+	view_name = strdup(m->site->name);
 
-	update_angles();
+	dirty |= ANGLES;
 }
 
 Hills * 
@@ -117,11 +205,13 @@ Panorama::get_mountains() {
 
 Hills * 
 Panorama::get_close_mountains() {
+	update();
 	return close_mountains;
 }
 
 Hills * 
 Panorama::get_visible_mountains() {
+	update();
 	return visible_mountains;
 }
 
@@ -129,9 +219,28 @@ int
 Panorama::comp_params(Hills *h) {
 	int ret;
 
+	update(h);
 	ret = proj->comp_params(h, &parms);
-	if (ret == 0)
-		update_visible_mountains(h);
+	if (ret == 0) {
+		dirty |= VISIBLE | COORDINATES;
+		update(h);
+	}
+
+	return ret;
+}
+
+// Like comp_params(), but ignores known hills that do not fit the
+// solution of the majority. These are added to rejected.
+int
+Panorama::comp_params_robust(Hills *h, Hills *rejected) {
+	int ret;
+
+	update(h);
+	ret = proj->comp_params_robust(h, &parms, MAX_REPROJECTION_ERROR, rejected);
+	if (ret == 0) {
+		dirty |= VISIBLE | COORDINATES;
+		update(h);
+	}
 
 	return ret;
 }
@@ -139,25 +248,25 @@ Panorama::comp_params(Hills *h) {
 void
 Panorama::set_center_angle(double a) {
 	parms.a_center = a * deg2rad;
-	update_visible_mountains();
+	dirty |= CENTER | COORDINATES;
 }
 
 void
 Panorama::set_nick_angle(double a) {
 	parms.a_nick = a * deg2rad;
-	update_coordinates();
+	dirty |= COORDINATES;
 }
 
 void
 Panorama::set_tilt_angle(double a) {
 	parms.a_tilt = a * deg2rad;
-	update_coordinates();
+	dirty |= COORDINATES;
 }
 
 void
 Panorama::set_scale(double s) {
 	parms.scale = s;
-	update_coordinates();
+	dirty |= COORDINATES;
 }
 
 void
@@ -172,31 +281,31 @@ Panorama::set_distortion_params(double k0, double k1, double x0) {
 	parms.k0 = k0;
 	parms.k1 = k1;
 	parms.x0 = x0;
-	update_coordinates();
+	dirty |= COORDINATES;
 }
 
 void
 Panorama::set_height_dist_ratio(double r) {
 	height_dist_ratio = r;
-	update_close_mountains();
+	dirty |= RATIO;
 }
 
 void
 Panorama::set_view_long(double v) {
 	view_lam = v * deg2rad;
-	update_angles();
+	dirty |= ANGLES;
 }
 
 void
 Panorama::set_view_lat(double v) {
 	view_phi = v * deg2rad;
-	update_angles();
+	dirty |= ANGLES;
 }
 
 void
 Panorama::set_view_height(double v) {
 	view_height = v;
-	update_angles();
+	dirty |= ANGLES;
 }
 
 void
@@ -217,7 +326,7 @@ Panorama::set_projection(ProjectionLSQ::Projection_t p) {
 			break;
 	}
 
-	update_angles();
+	dirty |= ANGLES;
 }
 
 const char *
@@ -277,104 +386,508 @@ Panorama::get_pos(const char *name) {
 	for (int i = 0; i < mountains->get_num(); i++) {
 		m = mountains->get(i);
 
-		if (strcmp(m->name, name) == 0) {
+		if (strcmp(m->site->name, name) == 0) {
 			ret = m;
 			fprintf(stderr, "Found matching entry: %s (%fm)\n",
-				m->name, m->height);
+				m->site->name, m->site->height);
 		}
 	}
 
 	return ret;
 }
 
-void 
+// Compute everything per-hill computations need from the viewpoint,
+// so that distance(), alpha(), nick() and refraction() get by
+// with dot products and a single arc function each.
+void
+Panorama::update_view_frame() {
+	double a, b, c, alpha = 6.5, T0 = 10.0;
+
+	view_ecef[0] = cos(view_phi) * cos(view_lam);
+	view_ecef[1] = cos(view_phi) * sin(view_lam);
+	view_ecef[2] = sin(view_phi);
+
+	view_east[0] = -sin(view_lam);
+	view_east[1] = cos(view_lam);
+	view_east[2] = 0.0;
+
+	view_north[0] = -sin(view_phi) * cos(view_lam);
+	view_north[1] = -sin(view_phi) * sin(view_lam);
+	view_north[2] = cos(view_phi);
+
+	view_radius = get_earth_radius(view_phi);
+
+	// approximation of refraction effect as described by Tom Chester at
+	// http://tchester.org/sgm/analysis/peaks/refraction.html
+	a = 2.9e-4 * exp (-view_height / 10000.0) / (1.0 + 2.9 * T0 / 760.0);
+	b = 2.9 * alpha / (760.0 * (1.0 + 2.9 * T0 / 760.0));
+	c = a * (b - 1.0 / 10.0);
+
+	refraction_coef = c / (2000.0 * (1.0 + a));
+}
+
+int
 Panorama::update_angles() {
+	update_view_frame();
+	ratio_mountains->clear();
+
 	for (int i = 0; i < mountains->get_num(); i++) {
 		Hill *m = mountains->get(i);
 
-		m->dist = distance(m->phi, m->lam);
-		if (m->phi != view_phi || m->lam != view_lam)
+		if (i % CANCEL_CHECK_INTERVAL == 0 && cancelled())
+			return 1;
+
+		m->dist = distance(m);
+		if (!is_viewpoint(m)) {
 			m->alph = alpha(m);
+			if (!(m->flags & Hill::TRACK_POINT))
+				ratio_mountains->add(m);
+		}
 	}
 
 	mountains->sort(Hills::SORT_ALPHA);
+	ratio_mountains->sort(Hills::SORT_HEIGHT_DIST);
 
-	update_close_mountains();
+	return 0;
 }
 
 void
 Panorama::set_hide_value(double h) {
 	hide_value = h;
-	update_visible_mountains();
+	dirty |= HIDDEN;
 }
 
+// update() gives up early as soon as cb(arg) returns non zero. It is
+// called from the updating thread. Stages that have not been completed
+// stay dirty, so the next update() continues there.
 void
-Panorama::mark_hidden(Hills *hills) {
+Panorama::set_cancel(int (*cb)(void *), void *arg) {
+	cancel_cb = cb;
+	cancel_arg = arg;
+}
+
+// return whether n hides m
+int
+Panorama::hides(const Hill *n, const Hill *m) {
 	double h;
 
+	if (n->flags & Hill::DUPLIC || n->flags & Hill::TRACK_POINT)
+		return 0;
+
+	if (m == n || fabs(m->alph - n->alph > pi_d / 2.0))
+		return 0;
+
+	if (m->dist < n->dist || m->a_nick > n->a_nick)
+		return 0;
+
+	h = (n->a_nick - m->a_nick) / fabs(m->alph - n->alph);
+
+	return isinf(h) || h > hide_value;
+}
+
+int
+Panorama::mark_hidden(Hills *hills) {
 	for (int i = 0; i < hills->get_num(); i++) {
 		Hill *m = hills->get(i);
 
+		if (i % CANCEL_CHECK_INTERVAL == 0 && cancelled())
+			return 1;
+
 		m->flags &= ~Hill::HIDDEN;
 
 		if (m->flags & Hill::DUPLIC)
 			continue;
 
 		for (int j = 0; j < hills->get_num(); j++) {
-			Hill *n = hills->get(j);
+			if (hides(hills->get(j), m)) {
+				m->flags |= Hill::HIDDEN;
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Update hidden flags after added have been added to close_mountains.
+void
+Panorama::mark_hidden_added(Hills *added) {
+	for (int i = 0; i < close_mountains->get_num(); i++) {
+		Hill *m = close_mountains->get(i);
+
+		if (m->flags & (Hill::DUPLIC | Hill::HIDDEN))
+			continue;
+
+		for (int j = 0; j < added->get_num(); j++) {
+			if (hides(added->get(j), m)) {
+				m->flags |= Hill::HIDDEN;
+				break;
+			}
+		}
+	}
 
-			if (n->flags & Hill::DUPLIC || n->flags & Hill::TRACK_POINT)
-				continue;
+	for (int i = 0; i < added->get_num(); i++) {
+		Hill *m = added->get(i);
 
-			if (m == n || fabs(m->alph - n->alph > pi_d / 2.0))
-				continue;
+		m->flags &= ~Hill::HIDDEN;
 
-			if (m->dist < n->dist || m->a_nick > n->a_nick)
-				continue;
+		if (m->flags & Hill::DUPLIC)
+			continue;
 
-			h = (n->a_nick - m->a_nick) / fabs(m->alph - n->alph);
-			if (isinf(h) || h > hide_value)
+		for (int j = 0; j < close_mountains->get_num(); j++) {
+			if (hides(close_mountains->get(j), m)) {
 				m->flags |= Hill::HIDDEN;
+				break;
+			}
 		}
 	}
 }
 
-void 
+// Update hidden flags after removed have been removed from
+// close_mountains. Only hills hidden by a removed one need to be
+// checked again.
+void
+Panorama::mark_hidden_removed(Hills *removed) {
+	for (int i = 0; i < close_mountains->get_num(); i++) {
+		Hill *m = close_mountains->get(i);
+		int recheck = 0;
+
+		if (!(m->flags & Hill::HIDDEN))
+			continue;
+
+		for (int j = 0; j < removed->get_num(); j++) {
+			if (hides(removed->get(j), m)) {
+				recheck = 1;
+				break;
+			}
+		}
+
+		if (!recheck)
+			continue;
+
+		m->flags &= ~Hill::HIDDEN;
+		for (int j = 0; j < close_mountains->get_num(); j++) {
+			if (hides(close_mountains->get(j), m)) {
+				m->flags |= Hill::HIDDEN;
+				break;
+			}
+		}
+	}
+}
+
+// Return the number of hills in ratio_mountains that pass the
+// visibility threshold. As ratio_mountains is sorted by height / dist
+// they are the first ones.
+int
+Panorama::count_ratio_close() {
+	int lo = 0, hi = ratio_mountains->get_num();
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		Hill *m = ratio_mountains->get(mid);
+
+		if (m->site->height / (m->dist * EARTH_RADIUS) > height_dist_ratio)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Whether m is at the viewpoint, so it has no direction.
+int
+Panorama::is_viewpoint(const Hill *m) {
+	return m->site->phi == view_phi && m->site->lam == view_lam;
+}
+
+// The flags are cleared on all hills, as the one at the viewpoint is
+// not in ratio_mountains.
+int
 Panorama::update_close_mountains() {
 	close_mountains->clear();
 
+	for (int i = 0; i < mountains->get_num(); i++)
+		mountains->get(i)->flags &= ~(Hill::CLOSE | Hill::VISIBLE);
+
+	num_ratio_close = count_ratio_close();
+	for (int i = 0; i < num_ratio_close; i++) {
+		Hill *m = ratio_mountains->get(i);
+
+		m->flags |= Hill::CLOSE;
+		m->a_nick = nick(m);
+		close_mountains->add(m);
+	}
+
 	for (int i = 0; i < mountains->get_num(); i++) {
 		Hill *m = mountains->get(i);
 
-		if (m->flags & Hill::TRACK_POINT ||
-			((m->phi != view_phi || m->lam != view_lam) &&
-			 (m->height / (m->dist * EARTH_RADIUS) > height_dist_ratio))) {
-
+		if (m->flags & Hill::TRACK_POINT && !is_viewpoint(m)) {
 			m->a_nick = nick(m);
 			close_mountains->add(m);
 		}
 	}
 
-	mark_hidden(close_mountains);
-	update_visible_mountains();
+	close_mountains->sort(Hills::SORT_ALPHA);
+
+	return mark_hidden(close_mountains);
 }
 
-void 
-Panorama::update_visible_mountains(Hills *excluded_hills) {
-	visible_mountains->clear();
+// Only hills that pass or fail the visibility threshold as a result
+// of a change of height_dist_ratio are touched.
+// Return whether close_mountains changed.
+int
+Panorama::update_ratio() {
+	int n = count_ratio_close();
+
+	if (n > num_ratio_close)
+		add_close_mountains(num_ratio_close, n);
+	else if (n < num_ratio_close)
+		remove_close_mountains(n, num_ratio_close);
+	else
+		return 0;
 
-	for (int i = 0; i < close_mountains->get_num(); i++) {
-		Hill *m = close_mountains->get(i);
+	num_ratio_close = n;
+	return 1;
+}
 
-		if (is_visible(m->alph)) {
-			visible_mountains->add(m);
+// Add ratio_mountains from .. to - 1 to close_mountains keeping them
+// sorted by alph.
+void
+Panorama::add_close_mountains(int from, int to) {
+	Hills added, *merged = new Hills();
+	int i = 0, j = 0;
+
+	for (int k = from; k < to; k++) {
+		Hill *m = ratio_mountains->get(k);
+
+		m->flags |= Hill::CLOSE;
+		m->a_nick = nick(m);
+		if (is_visible(m->alph))
 			m->flags |= Hill::VISIBLE;
-		} else {
+		else
 			m->flags &= ~Hill::VISIBLE;
+		added.add(m);
+	}
+
+	added.sort(Hills::SORT_ALPHA);
+
+	while (i < close_mountains->get_num() || j < added.get_num()) {
+		Hill *m = close_mountains->get(i);
+		Hill *n = added.get(j);
+
+		if (!n || (m && m->alph >= n->alph)) {
+			merged->add(m);
+			i++;
+		} else {
+			merged->add(n);
+			j++;
 		}
 	}
 
-	update_coordinates(excluded_hills);
+	delete close_mountains;
+	close_mountains = merged;
+
+	mark_hidden_added(&added);
+}
+
+// Remove ratio_mountains from .. to - 1 from close_mountains.
+void
+Panorama::remove_close_mountains(int from, int to) {
+	Hills removed, *remaining = new Hills();
+
+	for (int k = from; k < to; k++) {
+		Hill *m = ratio_mountains->get(k);
+
+		m->flags &= ~(Hill::CLOSE | Hill::VISIBLE);
+		removed.add(m);
+	}
+
+	for (int i = 0; i < close_mountains->get_num(); i++) {
+		Hill *m = close_mountains->get(i);
+
+		if (m->flags & (Hill::TRACK_POINT | Hill::CLOSE))
+			remaining->add(m);
+	}
+
+	delete close_mountains;
+	close_mountains = remaining;
+
+	mark_hidden_removed(&removed);
+}
+
+// Return the number of close mountains with alph > a, or alph >= a if
+// inclusive is set. As close_mountains is sorted by decreasing alph,
+// these are the first ones.
+int
+Panorama::count_alph_above(double a, int inclusive) {
+	int lo = 0, hi = close_mountains->get_num();
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		double alph = close_mountains->get(mid)->alph;
+
+		if (alph > a || (inclusive && alph == a))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Compute the index ranges of close_mountains that are visible, i.e.
+// within get_view_angle() of parms.a_center. If the view wraps around
+// north, there are two ranges.
+void
+Panorama::comp_visible_range(int from[2], int to[2]) {
+	double view_angle = proj->get_view_angle();
+	double c = fmod(parms.a_center, 2.0 * pi_d);
+	double lo, hi;
+
+	if (c < 0.0)
+		c += 2.0 * pi_d;
+
+	from[1] = to[1] = 0;
+
+	if (view_angle >= pi_d) {
+		from[0] = 0;
+		to[0] = close_mountains->get_num();
+		return;
+	}
+
+	lo = c - view_angle;
+	hi = c + view_angle;
+
+	if (lo < 0.0) {
+		from[0] = count_alph_above(2.0 * pi_d, 1);
+		to[0] = count_alph_above(lo + 2.0 * pi_d, 0);
+		from[1] = count_alph_above(hi, 1);
+		to[1] = close_mountains->get_num();
+	} else if (hi > 2.0 * pi_d) {
+		from[0] = count_alph_above(2.0 * pi_d, 1);
+		to[0] = count_alph_above(lo, 0);
+		from[1] = count_alph_above(hi - 2.0 * pi_d, 1);
+		to[1] = close_mountains->get_num();
+	} else {
+		from[0] = count_alph_above(hi, 1);
+		to[0] = count_alph_above(lo, 0);
+	}
+}
+
+static inline int
+in_range(int i, const int from[2], const int to[2]) {
+	return (i >= from[0] && i < to[0]) || (i >= from[1] && i < to[1]);
+}
+
+void 
+Panorama::update_visible_mountains() {
+	for (int i = 0; i < close_mountains->get_num(); i++)
+		close_mountains->get(i)->flags &= ~Hill::VISIBLE;
+
+	comp_visible_range(visible_from, visible_to);
+
+	for (int r = 0; r < 2; r++)
+		for (int i = visible_from[r]; i < visible_to[r]; i++)
+			close_mountains->get(i)->flags |= Hill::VISIBLE;
+
+	fill_visible_mountains();
+}
+
+// Update visibility after a change of parms.a_center. Only the flags
+// of hills entering or leaving the view are changed.
+void
+Panorama::move_visible_mountains() {
+	int from[2], to[2];
+
+	comp_visible_range(from, to);
+
+	for (int r = 0; r < 2; r++) {
+		for (int i = visible_from[r]; i < visible_to[r]; i++)
+			if (!in_range(i, from, to))
+				close_mountains->get(i)->flags &= ~Hill::VISIBLE;
+
+		for (int i = from[r]; i < to[r]; i++)
+			if (!in_range(i, visible_from, visible_to))
+				close_mountains->get(i)->flags |= Hill::VISIBLE;
+	}
+
+	for (int r = 0; r < 2; r++) {
+		visible_from[r] = from[r];
+		visible_to[r] = to[r];
+	}
+
+	fill_visible_mountains();
+}
+
+void
+Panorama::fill_visible_mountains() {
+	visible_mountains->clear();
+
+	for (int r = 0; r < 2; r++)
+		for (int i = visible_from[r]; i < visible_to[r]; i++)
+			visible_mountains->add(close_mountains->get(i));
+}
+
+// Recompute all dirty stages and the ones depending on them.
+// Coordinates of excluded_hills are left alone.
+// Return 1 if cancelled, see set_cancel().
+int
+Panorama::update(Hills *excluded_hills) {
+	int d = dirty;
+	int close_changed = 0, visible_changed = 1;
+
+	if (!d)
+		return 0;
+
+	// Clear first, the stages below use getters that call update().
+	dirty = 0;
+
+	if (d & ANGLES) {
+		if (update_angles() != 0) {
+			dirty |= d;
+			return 1;
+		}
+		d = (d & ~ANGLES) | CLOSE;
+	}
+
+	if (d & CLOSE) {
+		if (update_close_mountains() != 0) {
+			dirty |= d;
+			return 1;
+		}
+		d = (d & ~(CLOSE | RATIO | HIDDEN)) | VISIBLE;
+	} else {
+		if (d & RATIO) {
+			close_changed = update_ratio();
+			d &= ~RATIO;
+		}
+
+		if (d & HIDDEN && mark_hidden(close_mountains) != 0) {
+			// the visible range has to be found again for the
+			// changed close_mountains
+			dirty |= d | (close_changed ? VISIBLE : 0);
+			return 1;
+		}
+	}
+
+	// The incremental updates of visible_mountains rely on the flags
+	// of all close hills being valid for the current center.
+	if (d & VISIBLE || (close_changed && d & CENTER)) {
+		update_visible_mountains();
+	} else if (d & CENTER) {
+		move_visible_mountains();
+	} else if (close_changed) {
+		comp_visible_range(visible_from, visible_to);
+		fill_visible_mountains();
+	} else {
+		visible_changed = 0;
+	}
+
+	if (visible_changed || d & COORDINATES)
+		update_coordinates(excluded_hills);
+
+	return 0;
 }
 
 void
@@ -386,71 +899,70 @@ Panorama::update_coordinates(Hills *excluded_hills) {
 	}
 }
 
+static inline double
+dot(const double *a, const double *b) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// Central angle between viewpoint and m. Also stores its sine and
+// cosine in m for nick() and get_real_distance().
 double 
-Panorama::distance(double phi, double lam) {
-	double d_lam = view_lam - lam;
+Panorama::distance(Hill *m) {
+	double cr[3];
+
+	const double *e = m->site->ecef;
 
-	return atan2(sqrt(pow(cos(phi) * sin(d_lam), 2.0) +
-				pow(cos(view_phi) * sin(phi) - sin(view_phi) * cos(phi) * cos(d_lam), 2.0)),
-		sin(view_phi) * sin(phi) + cos(view_phi) * cos(phi) * cos(d_lam));
+	cr[0] = view_ecef[1] * e[2] - view_ecef[2] * e[1];
+	cr[1] = view_ecef[2] * e[0] - view_ecef[0] * e[2];
+	cr[2] = view_ecef[0] * e[1] - view_ecef[1] * e[0];
+
+	m->sin_dist = sqrt(dot(cr, cr));
+	m->cos_dist = dot(view_ecef, e);
+
+	return atan2(m->sin_dist, m->cos_dist);
 }
 
 double 
 Panorama::alpha(const Hill *m) {
 	double sin_alph, cos_alph;
 
-	sin_alph = sin(m->lam - view_lam) * cos(m->phi) / sin(m->dist);
-	cos_alph = (sin(m->phi) - sin(view_phi) * cos(m->dist)) /
-		(cos(view_phi) * sin(m->dist));
+	sin_alph = dot(view_east, m->site->ecef);
+	cos_alph = dot(view_north, m->site->ecef);
 
 	return fmod(atan2(sin_alph, cos_alph) + 2.0 * pi_d, 2.0 * pi_d);
 }
 
-// approximation of refraction effect as described by Tom Chester at
-// http://tchester.org/sgm/analysis/peaks/refraction.html
 double
 Panorama::refraction(const Hill *m) {
-	double a, b, c, alpha = 6.5, T0 = 10.0;
-
-	a = 2.9e-4 * exp (-view_height / 10000.0) / (1.0 + 2.9 * T0 / 760.0);
-	b = 2.9 * alpha / (760.0 * (1.0 + 2.9 * T0 / 760.0));
-	c = a * (b - 1.0 / 10.0);
-
-	return c * get_real_distance(m) / (2000.0 * (1.0 + a));
+	return refraction_coef * get_real_distance(m);
 }
 
 double
 Panorama::nick(const Hill *m) {
 	double b, c, theta = refraction(m);
 
-	b = m->height + get_earth_radius(m->phi);
-	c = view_height + get_earth_radius(view_phi);
+	b = m->site->height + m->site->radius;
+	c = view_height + view_radius;
 
-	return atan((cos(m->dist) * b - c) / (sin(m->dist) * b)) - theta;
+	return atan((m->cos_dist * b - c) / (m->sin_dist * b)) - theta;
 }
 
 // return local distance to center of WGS84 ellipsoid
 double
 Panorama::get_earth_radius(double phi) {
-	double a = 6378137.000;
-	double b = 6356752.315;
-	double r;
-	double ata = tan(phi);
-
-	r = a*pow(pow(ata,2)+1,1.0/2.0)*fabs(b)*pow(pow(b,2)+pow(a,2)*pow(ata,2),-1.0/2.0);
-	return r;
+	return Site::earth_radius(phi);
 }
 
 double
 Panorama::get_real_distance(const Hill *m) {
-	double a, b, c, gam;
+	double a, b;
+
+	update();
 
-	a = view_height + get_earth_radius(view_phi);
-	b = m->height + get_earth_radius(m->phi); 
-	gam = m->dist;
+	a = view_height + view_radius;
+	b = m->site->height + m->site->radius;
 
-	c = sqrt(pow(a, 2.0) + pow(b, 2.0) - 2.0 * a * b * cos(gam));
-	return c;
+	return sqrt(a * a + b * b - 2.0 * a * b * m->cos_dist);
 }
 
 int
@@ -0,0 +1,89 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "Parallel.H"
+
+#define MAX_THREADS 64
+
+struct run_data {
+	Parallel::job_t job;
+	void *data;
+	int num_jobs;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static void *
+worker(void *p) {
+	struct run_data *rd = (struct run_data *) p;
+	int n;
+
+	for (;;) {
+		pthread_mutex_lock(&rd->lock);
+		n = rd->next++;
+		pthread_mutex_unlock(&rd->lock);
+
+		if (n >= rd->num_jobs)
+			break;
+
+		rd->job(n, rd->data);
+	}
+
+	return NULL;
+}
+
+int
+Parallel::num_cpus() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int) n : 1;
+}
+
+int
+Parallel::run(int num_jobs, job_t job, void *data, int num_threads) {
+	pthread_t threads[MAX_THREADS];
+	struct run_data rd;
+	int started = 0;
+
+	if (num_jobs <= 0)
+		return 0;
+
+	if (num_threads <= 0)
+		num_threads = num_cpus();
+	if (num_threads > num_jobs)
+		num_threads = num_jobs;
+	if (num_threads > MAX_THREADS)
+		num_threads = MAX_THREADS;
+
+	rd.job = job;
+	rd.data = data;
+	rd.num_jobs = num_jobs;
+	rd.next = 0;
+	pthread_mutex_init(&rd.lock, NULL);
+
+	// The calling thread works as well, so start one thread less.
+	for (int i = 0; i < num_threads - 1; i++) {
+		if (pthread_create(&threads[started], NULL, worker, &rd) != 0) {
+			perror("pthread_create");
+			break;
+		}
+		started++;
+	}
+
+	worker(&rd);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&rd.lock);
+
+	return 0;
+}
@@ -7,8 +7,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 
 #include <FL/Fl.H>
+#include <FL/Fl_Window.H>
 #include <FL/fl_draw.H>
 
 #include "PreviewOutputImage.H"
@@ -54,6 +56,46 @@ PreviewOutputImage::next_line_internal() {
 	return 0;
 }
 
+// Set the size x size pixels at x, y, for progressive rendering.
+int
+PreviewOutputImage::set_block(int x, int y, int size, int r, int g, int b) {
+	if (!data || x < 0 || y < 0 || x >= W || y >= H)
+		return 1;
+
+	for (int j = y; j < std::min(y + size, H); j++) {
+		uchar *p = data + ((long) j * W + x) * d;
+
+		for (int i = x; i < std::min(x + size, W); i++) {
+			*p++ = (unsigned char) (r / 255);
+			*p++ = (unsigned char) (g / 255);
+			*p++ = (unsigned char) (b / 255);
+		}
+	}
+
+	return 0;
+}
+
+// Show what is rendered so far. Returns 1 once the preview window
+// was closed.
+int
+PreviewOutputImage::refresh() {
+	redraw();
+	Fl::check();
+
+	return window() && window()->shown() ? 0 : 1;
+}
+
+int
+PreviewOutputImage::write_row_internal(const void *r, row_format_t fmt) {
+	if (!data)
+		return 1;
+
+	convert_row(r, fmt, data + (long) line * W * d, d, W);
+	line++;
+
+	return next_line_internal();
+}
+
 void
 PreviewOutputImage::draw() {
 	if (!data)
@@ -13,7 +13,16 @@
 
 int
 ProjectionCylindrical::comp_params(const Hills *h, ViewParams *parms) {
-	Hills h_monotone(h);
+	// Work on copies, as the hills are shared with the Panorama, which
+	// keeps them sorted by alph.
+	Hill *copies = new Hill[h->get_num()];
+	Hills h_monotone;
+	int ret;
+
+	for (int i = 0; i < h->get_num(); i++) {
+		copies[i] = *h->get(i);
+		h_monotone.add(&copies[i]);
+	}
 
 	h_monotone.sort(Hills::SORT_X);
 
@@ -22,5 +31,9 @@ ProjectionCylindrical::comp_params(const Hills *h, ViewParams *parms) {
 		if (h_monotone.get(i)->alph < h_monotone.get(i - 1)->alph)
 			h_monotone.get(i)->alph += asin(1.0) * 4.0; // += 2pi
 
-	return ProjectionLSQ::comp_params(&h_monotone, parms);
+	ret = ProjectionLSQ::comp_params(&h_monotone, parms);
+
+	delete [] copies;
+
+	return ret;
 }
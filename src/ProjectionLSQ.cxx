@@ -15,8 +15,12 @@
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_multifit_nlin.h>
 
+#include "Parallel.H"
 #include "ProjectionLSQ.H"
 
+#define RANSAC_MAX_HYPOTHESES 500
+#define RANSAC_MIN_INLIERS    3
+
 double ProjectionLSQ::pi = asin(1.0) * 2.0;
 
 double
@@ -51,8 +55,9 @@ ProjectionLSQ::comp_params(const Hills *h, ViewParams *parms) {
 		scale_tmp = comp_scale(m1->alph, m2->alph, m1->x, m2->x);
 
 		if (isnan(scale_tmp) || scale_tmp < 50.0) {
-			fprintf(stderr, "Could not determine initial scale value (%f)\n",
-				scale_tmp);
+			if (!quiet)
+				fprintf(stderr, "Could not determine initial scale value (%f)\n",
+					scale_tmp);
 			return 1;
 		}
 
@@ -61,7 +66,8 @@ ProjectionLSQ::comp_params(const Hills *h, ViewParams *parms) {
 	}
 
 	if (known_hills > 3) {
-		fprintf(stderr, "Performing calibration\n");
+		if (!quiet)
+			fprintf(stderr, "Performing calibration\n");
 		new_parms.k0 = 0.0;
 		new_parms.k1 = 0.0;
 		new_parms.x0 = 0.0;
@@ -77,7 +83,8 @@ ProjectionLSQ::comp_params(const Hills *h, ViewParams *parms) {
 	}
 
 	if (isnan(new_parms.scale) || new_parms.scale < 50.0) {
-		fprintf(stderr, "Could not determine reasonable view parameters\n");
+		if (!quiet)
+			fprintf(stderr, "Could not determine reasonable view parameters\n");
 		return 1;
 	}
 
@@ -86,6 +93,151 @@ ProjectionLSQ::comp_params(const Hills *h, ViewParams *parms) {
 	return 0;
 }
 
+double
+ProjectionLSQ::reprojection_error(const Hill *m, const ViewParams *parms) {
+	double x, y;
+
+	get_coordinates(m->alph, m->a_nick, parms, &x, &y);
+
+	return sqrt(pow(x - m->x, 2.0) + pow(y - m->y, 2.0));
+}
+
+struct hypothesis {
+	int m1, m2;
+	int inliers;
+	double err;
+	ViewParams parms;
+};
+
+struct ransac_data {
+	ProjectionLSQ *p;
+	const Hills *h;
+	const ViewParams *parms;
+	double max_err;
+	struct hypothesis *hyp;
+};
+
+// Solve for the hypothesis given by a minimal subset of two hills and
+// count the hills that it reprojects within max_err pixels.
+// Runs concurrently for different n, comp_params() does not modify the
+// hills.
+void
+ProjectionLSQ::ransac_job(int n, void *data) {
+	struct ransac_data *rd = (struct ransac_data *) data;
+	struct hypothesis *hyp = &rd->hyp[n];
+	Hills sample;
+
+	hyp->inliers = 0;
+	hyp->err = 0.0;
+	hyp->parms = *rd->parms;
+
+	sample.add(rd->h->get(hyp->m1));
+	sample.add(rd->h->get(hyp->m2));
+
+	if (rd->p->comp_params(&sample, &hyp->parms) != 0)
+		return;
+
+	for (int i = 0; i < rd->h->get_num(); i++) {
+		double err = rd->p->reprojection_error(rd->h->get(i), &hyp->parms);
+
+		if (err < rd->max_err) {
+			hyp->inliers++;
+			hyp->err += err;
+		}
+	}
+}
+
+int
+ProjectionLSQ::comp_params_robust(const Hills *h, ViewParams *parms,
+	double max_err, Hills *rejected) {
+	struct ransac_data rd;
+	struct hypothesis *best = NULL;
+	Hills inliers;
+	int known_hills = h->get_num();
+	int num_hyp, n;
+
+	if (known_hills < 3)
+		return comp_params(h, parms);
+
+	num_hyp = known_hills * (known_hills - 1) / 2;
+	if (num_hyp > RANSAC_MAX_HYPOTHESES)
+		num_hyp = RANSAC_MAX_HYPOTHESES;
+
+	rd.hyp = (struct hypothesis *) calloc(num_hyp, sizeof(struct hypothesis));
+	if (!rd.hyp) {
+		perror("calloc");
+		return 1;
+	}
+
+	if (num_hyp < known_hills * (known_hills - 1) / 2) {
+		// too many pairs, sample them randomly
+		gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+		int *idx = (int *) malloc(known_hills * sizeof(int));
+		int pair[2];
+
+		for (int i = 0; i < known_hills; i++)
+			idx[i] = i;
+
+		for (int i = 0; i < num_hyp; i++) {
+			// two different hills
+			gsl_ran_choose(rng, pair, 2, idx, known_hills, sizeof(int));
+			rd.hyp[i].m1 = pair[0];
+			rd.hyp[i].m2 = pair[1];
+		}
+
+		gsl_rng_free(rng);
+		free(idx);
+	} else {
+		n = 0;
+		for (int i = 0; i < known_hills; i++) {
+			for (int j = i + 1; j < known_hills; j++) {
+				rd.hyp[n].m1 = i;
+				rd.hyp[n].m2 = j;
+				n++;
+			}
+		}
+	}
+
+	rd.p = this;
+	rd.h = h;
+	rd.parms = parms;
+	rd.max_err = max_err;
+
+	quiet++;
+	Parallel::run(num_hyp, ransac_job, &rd);
+	quiet--;
+
+	for (int i = 0; i < num_hyp; i++) {
+		struct hypothesis *hyp = &rd.hyp[i];
+
+		if (!best || hyp->inliers > best->inliers ||
+			(hyp->inliers == best->inliers && hyp->err < best->err))
+			best = hyp;
+	}
+
+	// The two hills of a hypothesis always fit, so a third one is
+	// needed to confirm it.
+	if (best->inliers < RANSAC_MIN_INLIERS) {
+		fprintf(stderr, "Could not find consistent subset of known hills\n");
+		free(rd.hyp);
+		return 1;
+	}
+
+	// refine using all inliers of the best hypothesis
+	for (int i = 0; i < known_hills; i++) {
+		Hill *m = h->get(i);
+
+		if (reprojection_error(m, &best->parms) < max_err)
+			inliers.add(m);
+		else if (rejected)
+			rejected->add(m);
+	}
+
+	free(rd.hyp);
+
+	return comp_params(&inliers, parms);
+}
+
 struct data {
 	ProjectionLSQ *p;
 	int level;
@@ -0,0 +1,209 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+
+#include <FL/Fl.H>
+
+#include "BitmapFont.H"
+#include "RasterCanvas.H"
+
+RasterCanvas::RasterCanvas() {
+	rgb = NULL;
+	W = Y = H = 0;
+	cap = 0;
+	r = g = b = 0;
+}
+
+RasterCanvas::~RasterCanvas() {
+	if (rgb)
+		free(rgb);
+}
+
+unsigned char *
+RasterCanvas::set_band(int w, int y, int h) {
+	if (w * h * 3 > cap) {
+		cap = w * h * 3;
+		rgb = (unsigned char *) realloc(rgb, cap);
+	}
+
+	W = w;
+	Y = y;
+	H = h;
+
+	return rgb;
+}
+
+void
+RasterCanvas::span(int x0, int x1, int y) {
+	unsigned char *p;
+
+	if (y < Y || y >= Y + H)
+		return;
+
+	x0 = std::max(x0, 0);
+	x1 = std::min(x1, W - 1);
+
+	p = rgb + ((long) (y - Y) * W + x0) * 3;
+	for (int x = x0; x <= x1; x++) {
+		*p++ = r;
+		*p++ = g;
+		*p++ = b;
+	}
+}
+
+// Filled circle of diameter width, i.e. a round line end or joint.
+void
+RasterCanvas::disc(int x, int y, int width) {
+	int rad = width / 2;
+	double r2 = (double) width * width / 4.0;
+
+	for (int dy = -rad; dy <= rad; dy++) {
+		int dx = (int) sqrt(std::max(r2 - dy * dy, 0.0));
+
+		span(x - dx, x + dx, y + dy);
+	}
+}
+
+void
+RasterCanvas::color(Fl_Color c) {
+	Fl::get_color(c, r, g, b);
+}
+
+void
+RasterCanvas::xyline(int x, int y, int x1) {
+	span(std::min(x, x1), std::max(x, x1), y);
+}
+
+void
+RasterCanvas::yxline(int x, int y, int y1) {
+	int y0 = std::max(std::min(y, y1), Y);
+
+	y1 = std::min(std::max(y, y1), Y + H - 1);
+
+	for (y = y0; y <= y1; y++)
+		pixel(x, y);
+}
+
+// Bresenham, with a disc at each point for wide lines, which gives
+// the round caps and joins of the screen version.
+void
+RasterCanvas::line(int x0, int y0, int x1, int y1, int width) {
+	int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+	int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+	int err = dx + dy;
+	int rad = width / 2;
+
+	if (std::max(y0, y1) + rad < Y || std::min(y0, y1) - rad >= Y + H)
+		return;
+
+	for (;;) {
+		if (width > 1)
+			disc(x0, y0, width);
+		else
+			pixel(x0, y0);
+
+		if (x0 == x1 && y0 == y1)
+			break;
+
+		int e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			x0 += sx;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			y0 += sy;
+		}
+	}
+}
+
+// Filled triangle, sampled at pixel centers.
+void
+RasterCanvas::polygon(int x0, int y0, int x1, int y1, int x2, int y2) {
+	int px[3] = {x0, x1, x2}, py[3] = {y0, y1, y2};
+	int top = std::max(std::min(y0, std::min(y1, y2)), Y);
+	int bottom = std::min(std::max(y0, std::max(y1, y2)), Y + H - 1);
+
+	for (int y = top; y <= bottom; y++) {
+		double yc = y + 0.5, xmin = INFINITY, xmax = -INFINITY;
+
+		for (int i = 0; i < 3; i++) {
+			int j = (i + 1) % 3;
+
+			if ((py[i] <= yc && yc < py[j]) || (py[j] <= yc && yc < py[i])) {
+				double x = px[i] + (yc - py[i]) * (px[j] - px[i]) /
+					(double) (py[j] - py[i]);
+
+				xmin = std::min(xmin, x);
+				xmax = std::max(xmax, x);
+			}
+		}
+
+		if (xmin <= xmax)
+			span((int) ceil(xmin - 0.5), (int) floor(xmax - 0.5), y);
+	}
+}
+
+// Midpoint circle outline.
+void
+RasterCanvas::circle(int x, int y, int rad) {
+	int dx = rad, dy = 0, err = 1 - rad;
+
+	if (y + rad < Y || y - rad >= Y + H)
+		return;
+
+	while (dx >= dy) {
+		pixel(x + dx, y + dy);
+		pixel(x - dx, y + dy);
+		pixel(x + dx, y - dy);
+		pixel(x - dx, y - dy);
+		pixel(x + dy, y + dx);
+		pixel(x - dy, y + dx);
+		pixel(x + dy, y - dx);
+		pixel(x - dy, y - dx);
+
+		dy++;
+		if (err < 0) {
+			err += 2 * dy + 1;
+		} else {
+			dx--;
+			err += 2 * (dy - dx) + 1;
+		}
+	}
+}
+
+void
+RasterCanvas::text(const char *s, int x, int y) {
+	int top = y - BitmapFont::ASCENT;
+
+	if (top >= Y + H || top + BitmapFont::HEIGHT <= Y)
+		return;
+
+	for (; *s && x < W; s++) {
+		int a;
+		const unsigned char *rows = BitmapFont::glyph(*s, &a);
+
+		for (int i = 0; i < BitmapFont::HEIGHT; i++)
+			for (int j = 0; j < 8; j++)
+				if (rows[i] & (0x80 >> j))
+					pixel(x + j, top + i);
+
+		x += a;
+	}
+}
+
+int
+RasterCanvas::text_width(const char *s) {
+	return BitmapFont::width(s);
+}
+
+int
+RasterCanvas::text_height() {
+	return BitmapFont::height();
+}
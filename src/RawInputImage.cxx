@@ -0,0 +1,130 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "RawOutputImage.H"
+#include "RawInputImage.H"
+
+RawInputImage::RawInputImage() {
+	file = NULL;
+	map = NULL;
+	map_size = 0;
+	width = 0;
+	height = 0;
+}
+
+RawInputImage::~RawInputImage() {
+	if (map)
+		munmap(map, map_size);
+	if (file)
+		free(file);
+}
+
+static uint32_t
+get32(const unsigned char *p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t
+get64(const unsigned char *p) {
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+int
+RawInputImage::load(const char *f) {
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(f, O_RDONLY)) < 0) {
+		perror(f);
+		return 1;
+	}
+
+	if (fstat(fd, &sb) != 0 || sb.st_size < RawOutputImage::HEADER_SIZE) {
+		fprintf(stderr, "%s: not a raw image\n", f);
+		close(fd);
+		return 1;
+	}
+
+	map_size = sb.st_size;
+	map = (unsigned char *) mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		map = NULL;
+		return 1;
+	}
+
+	width = get32(map + 12);
+	height = get32(map + 16);
+	bits = get32(map + 20);
+	samples = get32(map + 24);
+	pixel_offset = get64(map + 32);
+	row_bytes = get64(map + 40);
+	first_row = get32(map + 56);
+	full_height = get32(map + 60);
+	if (full_height == 0) // written without shard fields
+		full_height = height;
+
+	if (memcmp(map, "GIPFRAW1", 8) != 0 || get32(map + 8) != 0x01020304 ||
+		(bits != 8 && bits != 16) || (samples != 3 && samples != 4) ||
+		row_bytes < (size_t) width * samples * (bits / 8) ||
+		pixel_offset + row_bytes * height > map_size ||
+		first_row + height > full_height) {
+		fprintf(stderr, "%s: not a raw image\n", f);
+		munmap(map, map_size);
+		map = NULL;
+		width = height = 0;
+		return 1;
+	}
+
+	file = strdup(f);
+
+	return 0;
+}
+
+int
+RawInputImage::get_row(int y, unsigned short *rgba) const {
+	const unsigned char *p;
+
+	if (!map || y < 0 || y >= height)
+		return 1;
+
+	p = map + pixel_offset + y * row_bytes;
+
+	for (int x = 0; x < width; x++) {
+		for (int c = 0; c < 4; c++) {
+			int v;
+
+			if (c == 3 && samples == 3)
+				v = 65025;
+			else if (bits == 8)
+				v = p[x * samples + c] * 255;
+			else
+				v = ((const uint16_t *) p)[x * samples + c];
+
+			rgba[x * 4 + c] = v;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,210 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "RawOutputImage.H"
+
+RawOutputImage::RawOutputImage(const char *f, int b) : OutputImage() {
+	file = strdup(f);
+	bitspersample = (b == 16) ? 16 : 8;
+	coverage = true;
+	sources = false;
+	fd = -1;
+	map = NULL;
+	map_size = 0;
+	shard_y = 0;
+	shard_h = 0;
+}
+
+RawOutputImage::~RawOutputImage() {
+	unmap();
+
+	if (file)
+		free(file);
+}
+
+void
+RawOutputImage::set_coverage(bool c) {
+	if (!map)
+		coverage = c;
+}
+
+void
+RawOutputImage::set_sources(bool s) {
+	if (!map)
+		sources = s;
+}
+
+void
+RawOutputImage::set_shard(int y, int full_h) {
+	if (!map) {
+		shard_y = y;
+		shard_h = full_h;
+	}
+}
+
+void
+RawOutputImage::unmap() {
+	if (map)
+		munmap(map, map_size);
+	map = NULL;
+
+	if (fd >= 0)
+		close(fd);
+	fd = -1;
+}
+
+static void
+put32(unsigned char *p, uint32_t v) {
+	memcpy(p, &v, sizeof(v));
+}
+
+static void
+put64(unsigned char *p, uint64_t v) {
+	memcpy(p, &v, sizeof(v));
+}
+
+int
+RawOutputImage::init_internal() {
+	int samples = coverage ? 4 : 3;
+
+	unmap();
+
+	row_bytes = (size_t) W * samples * (bitspersample / 8);
+	pixel_offset = HEADER_SIZE;
+	map_size = pixel_offset + row_bytes * H;
+	source_offset = 0;
+	if (sources) {
+		// keep the uint16 plane aligned
+		source_offset = (map_size + 7) & ~(size_t) 7;
+		map_size = source_offset + (size_t) W * H * sizeof(uint16_t);
+	}
+
+	if ((fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(file);
+		return 1;
+	}
+
+	// The file is sparse, so rows not written read as zero, i.e. not
+	// covered and without source.
+	if (ftruncate(fd, map_size) != 0) {
+		perror("ftruncate");
+		unmap();
+		return 1;
+	}
+
+	map = (unsigned char *) mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		map = NULL;
+		unmap();
+		return 1;
+	}
+
+	memcpy(map, "GIPFRAW1", 8);
+	put32(map + 8, 0x01020304);
+	put32(map + 12, W);
+	put32(map + 16, H);
+	put32(map + 20, bitspersample);
+	put32(map + 24, samples);
+	put32(map + 28, bitspersample == 16 ? 65025 : 255);
+	put64(map + 32, pixel_offset);
+	put64(map + 40, row_bytes);
+	put64(map + 48, source_offset);
+	put32(map + 56, shard_h > 0 ? shard_y : 0);
+	put32(map + 60, shard_h > 0 ? shard_h : H);
+
+	return 0;
+}
+
+int
+RawOutputImage::set_pixel_internal(int x, int r, int g, int b) {
+	unsigned char *p;
+
+	if (!map || line >= H)
+		return 1;
+
+	p = map + pixel_offset + line * row_bytes;
+
+	if (bitspersample == 8) {
+		p += x * (coverage ? 4 : 3);
+		p[0] = r / 255;
+		p[1] = g / 255;
+		p[2] = b / 255;
+		if (coverage)
+			p[3] = 255;
+	} else {
+		uint16_t *p16 = (uint16_t *) p + x * (coverage ? 4 : 3);
+
+		p16[0] = r;
+		p16[1] = g;
+		p16[2] = b;
+		if (coverage)
+			p16[3] = 65025;
+	}
+
+	return 0;
+}
+
+int
+RawOutputImage::write_row_internal(const void *row, row_format_t fmt) {
+	int ret = write_row_at(line, row, fmt);
+
+	line++;
+
+	return ret;
+}
+
+int
+RawOutputImage::write_row_at(int y, const void *row, row_format_t fmt) {
+	unsigned char *p;
+
+	if (!map || y < 0 || y >= H)
+		return 1;
+
+	p = map + pixel_offset + y * row_bytes;
+
+	if (bitspersample == 8)
+		convert_row(row, fmt, p, coverage ? 4 : 3, W);
+	else
+		convert_row(row, fmt, (unsigned short *) p, coverage ? 4 : 3, W);
+
+	return 0;
+}
+
+int
+RawOutputImage::write_sources_at(int y, const unsigned short *src) {
+	if (!map || !source_offset || y < 0 || y >= H)
+		return 1;
+
+	memcpy(map + source_offset + (size_t) y * W * sizeof(uint16_t), src,
+		W * sizeof(uint16_t));
+
+	return 0;
+}
+
+int
+RawOutputImage::done_internal() {
+	int ret = 0;
+
+	if (map && msync(map, map_size, MS_SYNC) != 0) {
+		perror("msync");
+		ret = 1;
+	}
+
+	unmap();
+
+	return ret;
+}
@@ -0,0 +1,150 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "ReduceOutputImage.H"
+
+#define MAX_VALUE 65025
+
+ReduceOutputImage::ReduceOutputImage(OutputImage *o, int f) : OutputImage() {
+	out = o;
+	factor = std::max(f, 1);
+	row = NULL;
+	sum = NULL;
+	out_row = NULL;
+}
+
+ReduceOutputImage::~ReduceOutputImage() {
+	free_rows();
+}
+
+void
+ReduceOutputImage::free_rows() {
+	if (row)
+		free(row);
+	if (sum)
+		free(sum);
+	if (out_row)
+		free(out_row);
+	row = NULL;
+	sum = NULL;
+	out_row = NULL;
+}
+
+int
+ReduceOutputImage::init_internal() {
+	free_rows();
+
+	out_w = (W + factor - 1) / factor;
+	if (out->init(out_w, (H + factor - 1) / factor) != 0)
+		return 1;
+
+	row = (unsigned short *) calloc(W * 4, sizeof(unsigned short));
+	sum = (unsigned long long *) calloc(out_w * 4, sizeof(unsigned long long));
+	out_row = (unsigned short *) malloc(out_w * 4 * sizeof(unsigned short));
+	rows = 0;
+
+	return 0;
+}
+
+int
+ReduceOutputImage::set_pixel_internal(int x, int r, int g, int b) {
+	if (!row)
+		return 1;
+
+	row[x * 4 + 0] = r;
+	row[x * 4 + 1] = g;
+	row[x * 4 + 2] = b;
+	row[x * 4 + 3] = MAX_VALUE;
+
+	return 0;
+}
+
+int
+ReduceOutputImage::next_line_internal() {
+	return add_row();
+}
+
+int
+ReduceOutputImage::write_row_internal(const void *r, row_format_t fmt) {
+	if (!row)
+		return 1;
+
+	convert_row(r, fmt, row, 4, W);
+	line++;
+
+	return add_row();
+}
+
+// Add the current input row to the sums, emit an output row once a
+// box is complete.
+int
+ReduceOutputImage::add_row() {
+	if (!row)
+		return 1;
+
+	for (int x = 0; x < W; x++) {
+		unsigned long long *s = sum + (x / factor) * 4;
+		unsigned int a = row[x * 4 + 3];
+
+		s[0] += (unsigned long long) row[x * 4 + 0] * a;
+		s[1] += (unsigned long long) row[x * 4 + 1] * a;
+		s[2] += (unsigned long long) row[x * 4 + 2] * a;
+		s[3] += a;
+	}
+
+	memset(row, 0, W * 4 * sizeof(unsigned short));
+	rows++;
+
+	if (rows == factor || line >= H)
+		return emit_row();
+
+	return 0;
+}
+
+int
+ReduceOutputImage::emit_row() {
+	for (int x = 0; x < out_w; x++) {
+		unsigned long long *s = sum + x * 4;
+		// boxes at the right and bottom edge may be smaller
+		int n = std::min(factor, W - x * factor) * rows;
+
+		if (s[3] == 0) {
+			memset(out_row + x * 4, 0, 4 * sizeof(unsigned short));
+			continue;
+		}
+
+		out_row[x * 4 + 0] = (s[0] + s[3] / 2) / s[3];
+		out_row[x * 4 + 1] = (s[1] + s[3] / 2) / s[3];
+		out_row[x * 4 + 2] = (s[2] + s[3] / 2) / s[3];
+		out_row[x * 4 + 3] = std::max((s[3] + n / 2) / n, 1ULL);
+	}
+
+	memset(sum, 0, out_w * 4 * sizeof(unsigned long long));
+	rows = 0;
+
+	return out->write_row(out_row, RGBA_16);
+}
+
+int
+ReduceOutputImage::done_internal() {
+	int ret = 0;
+
+	// rows of an incomplete image
+	if (rows > 0 && emit_row() != 0)
+		ret = 1;
+
+	if (out->done() != 0)
+		ret = 1;
+
+	free_rows();
+
+	return ret;
+}
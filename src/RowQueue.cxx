@@ -0,0 +1,107 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "RowQueue.H"
+
+RowQueue::RowQueue(OutputImage *o, OutputImage::row_format_t f,
+	size_t size, int n) {
+	out = o;
+	fmt = f;
+	row_size = size;
+	num_rows = n > 0 ? n : 1;
+	rows = (unsigned char *) malloc(row_size * num_rows);
+	last = (bool *) calloc(num_rows, sizeof(bool));
+	head = 0;
+	tail = 0;
+	running = false;
+	ret = 0;
+	sem_init(&free_rows, 0, num_rows);
+	sem_init(&full_rows, 0, 0);
+}
+
+RowQueue::~RowQueue() {
+	finish();
+	sem_destroy(&free_rows);
+	sem_destroy(&full_rows);
+	free(last);
+	free(rows);
+}
+
+// Without an encoder thread rows are written by put_row() directly.
+int
+RowQueue::start() {
+	if (running)
+		return 0;
+
+	if (pthread_create(&thread, NULL, encode_main, this) != 0) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	running = true;
+
+	return 0;
+}
+
+void *
+RowQueue::encode_main(void *p) {
+	RowQueue *q = (RowQueue *) p;
+
+	for (;;) {
+		while (sem_wait(&q->full_rows) != 0)
+			;
+
+		// queued by finish() after the last row
+		if (q->last[q->tail])
+			break;
+
+		if (q->out->write_row(q->rows + q->tail * q->row_size, q->fmt) != 0)
+			q->ret = 1;
+
+		q->tail = (q->tail + 1) % q->num_rows;
+		sem_post(&q->free_rows);
+	}
+
+	return NULL;
+}
+
+void *
+RowQueue::get_row() {
+	while (sem_wait(&free_rows) != 0)
+		;
+
+	return rows + head * row_size;
+}
+
+void
+RowQueue::put_row() {
+	if (!running) {
+		if (out->write_row(rows + head * row_size, fmt) != 0)
+			ret = 1;
+		sem_post(&free_rows);
+		return;
+	}
+
+	last[head] = false;
+	head = (head + 1) % num_rows;
+	sem_post(&full_rows);
+}
+
+int
+RowQueue::finish() {
+	if (running) {
+		get_row();
+		last[head] = true;
+		sem_post(&full_rows);
+		pthread_join(thread, NULL);
+		running = false;
+	}
+
+	return ret;
+}
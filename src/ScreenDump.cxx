@@ -10,7 +10,7 @@
 
 #include "ScreenDump.H"
 
-ScreenDump::ScreenDump(Fl_Widget *widget) {
+ScreenDump::ScreenDump(GipfelWidget *widget) {
 	Fl_Offscreen offscreen;
 	int x, y;
 
@@ -24,8 +24,7 @@ ScreenDump::ScreenDump(Fl_Widget *widget) {
 
 	offscreen = fl_create_offscreen(w, h);
 	fl_begin_offscreen(offscreen);
-	widget->redraw();
-	widget->draw();
+	widget->draw_all();
 	fl_color(FL_YELLOW);
 	fl_draw("created with gipfel", w - 80, h - 10);
 	rgb = fl_read_image(NULL, 0, 0, w, h);
@@ -47,13 +46,8 @@ ScreenDump::save(OutputImage *out) {
 
 	out->init(w, h);
 
-	for (int y = 0; y < h; y++) {
-		for (int x = 0; x < w; x++) {
-			unsigned char *px = &rgb[(y * w + x) * 3];
-			out->set_pixel(x, px[0] * 255, px[1] * 255, px[2] * 255);
-		}
-		out->next_line();
-	}
+	for (int y = 0; y < h; y++)
+		out->write_row(&rgb[y * w * 3], OutputImage::RGB_8);
 
 	return out->done();
 }
@@ -0,0 +1,184 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <algorithm>
+
+#include "ScreenGrid.H"
+
+#define CELL_SIZE 32
+
+ScreenGrid::ScreenGrid() {
+	rects = NULL;
+	num_rects = cap_rects = 0;
+	entries = NULL;
+	num_entries = cap_entries = 0;
+	cells = NULL;
+	cap_cells = 0;
+	found = NULL;
+	stamps = NULL;
+	cap_owners = 0;
+	query = 0;
+	x0 = y0 = 0;
+	cols = rows = 0;
+}
+
+ScreenGrid::~ScreenGrid() {
+	if (rects)
+		free(rects);
+	if (entries)
+		free(entries);
+	if (cells)
+		free(cells);
+	if (found)
+		free(found);
+	if (stamps)
+		free(stamps);
+}
+
+// Clear the grid and cover the area x, y, w, h. Rectangles outside of
+// it are still found, they just share the border cells.
+void
+ScreenGrid::reset(int x, int y, int w, int h) {
+	x0 = x;
+	y0 = y;
+	cols = std::max(w, 1) / CELL_SIZE + 1;
+	rows = std::max(h, 1) / CELL_SIZE + 1;
+
+	if (cols * rows > cap_cells) {
+		cap_cells = cols * rows;
+		cells = (int *) realloc(cells, cap_cells * sizeof(int));
+	}
+
+	for (int i = 0; i < cols * rows; i++)
+		cells[i] = -1;
+
+	num_rects = 0;
+	num_entries = 0;
+}
+
+int
+ScreenGrid::col(int x) {
+	return std::min(std::max((x - x0) / CELL_SIZE, 0), cols - 1);
+}
+
+int
+ScreenGrid::row(int y) {
+	return std::min(std::max((y - y0) / CELL_SIZE, 0), rows - 1);
+}
+
+void
+ScreenGrid::add(int x, int y, int w, int h, int owner) {
+	int c0 = col(x), c1 = col(x + w);
+	int r0 = row(y), r1 = row(y + h);
+	rect_t *r;
+
+	if (num_rects >= cap_rects) {
+		cap_rects = cap_rects ? cap_rects * 2 : 256;
+		rects = (rect_t *) realloc(rects, cap_rects * sizeof(rect_t));
+	}
+
+	r = &rects[num_rects];
+	r->x0 = x;
+	r->y0 = y;
+	r->x1 = x + w;
+	r->y1 = y + h;
+	r->owner = owner;
+
+	if (owner >= cap_owners) {
+		int old_cap = cap_owners;
+
+		cap_owners = std::max(owner + 1, cap_owners * 2);
+		found = (int *) realloc(found, cap_owners * sizeof(int));
+		stamps = (int *) realloc(stamps, cap_owners * sizeof(int));
+		for (int i = old_cap; i < cap_owners; i++)
+			stamps[i] = 0;
+	}
+
+	for (int j = r0; j <= r1; j++) {
+		for (int i = c0; i <= c1; i++) {
+			if (num_entries >= cap_entries) {
+				cap_entries = cap_entries ? cap_entries * 2 : 1024;
+				entries = (entry_t *) realloc(entries,
+					cap_entries * sizeof(entry_t));
+			}
+
+			entries[num_entries].rect = num_rects;
+			entries[num_entries].next = cells[j * cols + i];
+			cells[j * cols + i] = num_entries++;
+		}
+	}
+
+	num_rects++;
+}
+
+int
+ScreenGrid::overlap(int x, int y, int w, int h, int ignore, int *top) {
+	int c0 = col(x), c1 = col(x + w);
+	int r0 = row(y), r1 = row(y + h);
+	int found = 0;
+
+	for (int j = r0; j <= r1; j++) {
+		for (int i = c0; i <= c1; i++) {
+			for (int e = cells[j * cols + i]; e >= 0; e = entries[e].next) {
+				rect_t *r = &rects[entries[e].rect];
+
+				if (r->owner == ignore ||
+					x > r->x1 || x + w < r->x0 ||
+					y > r->y1 || y + h < r->y0)
+					continue;
+
+				if (!found || r->y0 < *top)
+					*top = r->y0;
+				found = 1;
+			}
+		}
+	}
+
+	return found;
+}
+
+static int
+comp_int(const void *p1, const void *p2) {
+	return *(const int *) p1 - *(const int *) p2;
+}
+
+const int *
+ScreenGrid::find(int x, int y, int w, int h, int *num) {
+	int c0 = col(x), c1 = col(x + w);
+	int r0 = row(y), r1 = row(y + h);
+
+	*num = 0;
+
+	if (cols == 0 || cap_owners == 0)
+		return found;
+
+	if (++query == 0) { // wrapped, forget old stamps
+		for (int i = 0; i < cap_owners; i++)
+			stamps[i] = 0;
+		query = 1;
+	}
+
+	for (int j = r0; j <= r1; j++) {
+		for (int i = c0; i <= c1; i++) {
+			for (int e = cells[j * cols + i]; e >= 0; e = entries[e].next) {
+				rect_t *r = &rects[entries[e].rect];
+
+				if (stamps[r->owner] == query ||
+					x > r->x1 || x + w < r->x0 ||
+					y > r->y1 || y + h < r->y0)
+					continue;
+
+				stamps[r->owner] = query;
+				found[(*num)++] = r->owner;
+			}
+		}
+	}
+
+	qsort(found, *num, sizeof(int), comp_int);
+
+	return found;
+}
@@ -0,0 +1,181 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+extern "C" {
+#include "strsep.h"
+}
+#include "Site.H"
+
+static double pi_d = asin(1.0) * 2.0;
+static double deg2rad = pi_d / 180.0;
+
+// Everything Panorama needs per hill that does not depend on the
+// viewpoint is computed once here.
+Site::Site(const char *n, double p, double l, double h) {
+	name = strdup(n);
+	phi = p;
+	lam = l;
+	height = h;
+	ecef[0] = cos(phi) * cos(lam);
+	ecef[1] = cos(phi) * sin(lam);
+	ecef[2] = sin(phi);
+	radius = earth_radius(phi);
+	flags = 0;
+}
+
+Site::~Site() {
+	if (name)
+		free(name);
+}
+
+// return local distance to center of WGS84 ellipsoid
+double
+Site::earth_radius(double phi) {
+	double a = 6378137.000;
+	double b = 6356752.315;
+	double r;
+	double ata = tan(phi);
+
+	r = a*pow(pow(ata,2)+1,1.0/2.0)*fabs(b)*pow(pow(b,2)+pow(a,2)*pow(ata,2),-1.0/2.0);
+	return r;
+}
+
+Sites::Sites() {
+	num = 0;
+	cap = 100;
+	s = (Site **) malloc(cap * sizeof(Site *));
+}
+
+Sites::Sites(const Sites *h) {
+	num = h->num;
+	cap = h->cap;
+	s = (Site **) malloc(cap * sizeof(Site *));
+	memcpy(s, h->s, cap * sizeof(Site *));
+}
+
+Sites::~Sites() {
+	if (s)
+		free(s);
+}
+
+int
+Sites::load(const char *file) {
+	FILE *fp;
+	char buf[4000];
+	char *vals[10];
+	char **ap, *bp;
+	double phi, lam, height;
+	Site *m;
+	int n;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		perror("fopen");
+		return 1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		bp = buf;
+		memset(vals, 0, sizeof(vals));
+		n = 0;
+		for (ap = vals; (*ap = strsep(&bp, ",")) != NULL;) {
+			n++;
+			if (++ap >= &vals[10])
+				break;
+		}
+
+		// standard format including name and description
+		if (n == 6 && vals[1] && vals [3] && vals[4] && vals[5]) {
+			phi = atof(vals[3]) * deg2rad;
+			lam = atof(vals[4]) * deg2rad;
+			height = atof(vals[5]);
+
+			m = new Site(vals[1], phi, lam, height);
+
+			add(m);
+			// track point format
+		} else if (n == 3 && vals[0] && vals[1] && vals[2]) {
+			phi = atof(vals[0]) * deg2rad;
+			lam = atof(vals[1]) * deg2rad;
+			height = atof(vals[2]);
+
+			m = new Site("", phi, lam, height);
+
+			add(m);
+		}
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+void
+Sites::add(Site *s1) {
+	if (num >= cap) {
+		cap = cap ? cap * 2 : 100;
+		s = (Site **) realloc(s, cap * sizeof(Site *));
+	}
+
+	s[num++] = s1;
+}
+
+void
+Sites::add(const Sites *h) {
+	for (int i = 0; i < h->get_num(); i++)
+		add(h->get(i));
+}
+
+static int
+comp_sites_name(const void *n1, const void *n2) {
+	Site *s1 = *(Site **)n1;
+	Site *s2 = *(Site **)n2;
+	int r;
+
+	r = strcasecmp(s1->name, s2->name);
+	if (r == 0)
+		return (int) (s1->height - s2->height);
+	else
+		return r;
+}
+
+void
+Sites::sort_name() {
+	if (!s || num < 2)
+		return;
+
+	qsort(s, num, sizeof(Site *), comp_sites_name);
+}
+
+void
+Sites::clear() {
+	if (s) {
+		free(s);
+		s = NULL;
+	}
+	cap = 0;
+	num = 0;
+}
+
+void
+Sites::clobber() {
+	for (int i = 0; i < get_num(); i++)
+		delete get(i);
+
+	clear();
+}
+
+Site *
+Sites::get(int n) const {
+	if (n < 0 || n >= num)
+		return NULL;
+	else
+		return s[n];
+}
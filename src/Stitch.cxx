@@ -15,6 +15,13 @@
 #include <FL/Fl.H>
 
 #include "OutputImage.H"
+#include "PreviewOutputImage.H"
+#include "RawOutputImage.H"
+#include "TeeOutputImage.H"
+#include "TileOutputImage.H"
+#include "RawInputImage.H"
+#include "Parallel.H"
+#include "RowQueue.H"
 #include "Stitch.H"
 
 #define MAX_VALUE 65025
@@ -27,6 +34,8 @@ Stitch::Stitch() {
 		gipf[i] = NULL;
 
 	merged_image = NULL;
+	tee = NULL;
+	catalog = NULL;
 	num_pics = 0;
 }
 
@@ -36,6 +45,15 @@ Stitch::~Stitch() {
 			delete gipf[i];
 		else
 			break;
+
+	if (tee)
+		delete tee;
+
+	// after the images referring to it
+	if (catalog) {
+		catalog->clobber();
+		delete catalog;
+	}
 }
 
 int
@@ -63,6 +81,24 @@ Stitch::set_output(OutputImage *img) {
 	return ret;
 }
 
+void
+Stitch::add_output(OutputImage *img) {
+	if (!merged_image) {
+		merged_image = img;
+		return;
+	}
+
+	if (merged_image != tee) {
+		if (tee)
+			delete tee;
+		tee = new TeeOutputImage();
+		tee->add(merged_image);
+		merged_image = tee;
+	}
+
+	tee->add(img);
+}
+
 int
 Stitch::resample(ScanImage::mode_t m,
 	int w, int h, double view_start, double view_end) {
@@ -73,45 +109,389 @@ Stitch::resample(ScanImage::mode_t m,
 	double step_view = (view_end - view_start) / w;
 	int r, g, b;
 	int y_off = h / 2;
-	int merged_pixel_set;
 	double radius = (double) w / (view_end -view_start);
+	RowQueue *queue = NULL;
+	int ret = 0;
 
 	if (merged_image)
 		if (merged_image->init(w, h) != 0)
 			merged_image = NULL;
 
-	for (int y = 0; y < h; y++) {
+	// RGBA, alpha 0 where no image covers the panorama. Rows are
+	// encoded by a separate thread while the next ones are computed.
+	if (merged_image) {
+		queue = new RowQueue(merged_image, OutputImage::RGBA_16,
+			w * 4 * sizeof(unsigned short));
+		queue->start();
+	}
+
+	for (int y = 0; y < h && queue; y++) {
 		double a_nick = atan((double)(y_off - y)/radius);
+		unsigned short *row = (unsigned short *) queue->get_row();
+
+		memset(row, 0, w * 4 * sizeof(unsigned short));
 
 		for (int x = 0; x < w; x++) {
 			double a_view;
 			a_view = view_start + x * step_view;
-			merged_pixel_set = 0;
-			for (int i = 0; i < num_pics; i++) {
-				if (merged_pixel_set)
+
+			if (merged_pixel(m, a_view, a_nick, &r, &g, &b) == 0) {
+				row[x * 4 + 0] = r;
+				row[x * 4 + 1] = g;
+				row[x * 4 + 2] = b;
+				row[x * 4 + 3] = MAX_VALUE;
+			}
+		}
+
+		queue->put_row();
+	}
+
+	if (queue) {
+		ret = queue->finish();
+		delete queue;
+	}
+
+	if (merged_image && merged_image->done() != 0)
+		ret = 1;
+
+	return ret;
+}
+
+// Render w x h pixels into img coarse to fine: the whole panorama
+// with one sample per 16 x 16 block first, then per 4 x 4 block, then
+// at full resolution. Pixels sampled by a coarser pass are not sampled
+// again. Stops early if the preview window is closed.
+int
+Stitch::preview(ScanImage::mode_t m, PreviewOutputImage *img,
+	int w, int h, double view_start, double view_end) {
+	static const int steps[] = {16, 4, 1};
+
+	view_start = view_start * deg2rad;
+	view_end = view_end * deg2rad;
+
+	double step_view = (view_end - view_start) / w;
+	int r, g, b;
+	int y_off = h / 2;
+	double radius = (double) w / (view_end -view_start);
+
+	if (img->init(w, h) != 0)
+		return 1;
+
+	for (int i = 0; i < (int) (sizeof(steps) / sizeof(steps[0])); i++) {
+		int s = steps[i];
+		int prev = i > 0 ? steps[i - 1] : 0;
+
+		for (int y = 0; y < h; y += s) {
+			double a_nick = atan((double)(y_off - y)/radius);
+
+			for (int x = 0; x < w; x += s) {
+				if (prev && x % prev == 0 && y % prev == 0)
 					continue;
 
-				if (gipf[i]->get_pixel(m, a_view, a_nick,
-						&r, &g, &b) == 0) {
+				// uncovered blocks are black, as in resample(),
+				// not the color of the coarser pass
+				if (merged_pixel(m, view_start + x * step_view, a_nick,
+					&r, &g, &b) == 0)
+					img->set_block(x, y, s, r, g, b);
+				else if (prev)
+					img->set_block(x, y, s, 0, 0, 0);
+			}
+
+			// about every 10 lines of output, as in resample()
+			if ((y / s) % std::max(10 / s, 1) == 0 && img->refresh() != 0)
+				return 1;
+		}
+
+		if (img->refresh() != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+#define RAW_JOB_ROWS 16
+
+struct raw_data {
+	Stitch *st;
+	ScanImage::mode_t m;
+	RawOutputImage *img;
+	int w, h;
+	int first_row, num_rows;
+	double view_start, step_view, radius;
+	int ret;
+};
+
+// Resample RAW_JOB_ROWS rows of img starting at n * RAW_JOB_ROWS.
+void
+Stitch::raw_job(int n, void *data) {
+	struct raw_data *rd = (struct raw_data *) data;
+	int w = rd->w;
+	int y_off = rd->h / 2;
+	unsigned short *row, *src;
+	int r, g, b, s;
+
+	row = (unsigned short *) malloc(w * 4 * sizeof(unsigned short));
+	src = (unsigned short *) malloc(w * sizeof(unsigned short));
 
-					r = std::max(std::min(r, MAX_VALUE), 0);
-					g = std::max(std::min(g, MAX_VALUE), 0);
-					b = std::max(std::min(b, MAX_VALUE), 0);
+	for (int y = n * RAW_JOB_ROWS;
+		y < std::min((n + 1) * RAW_JOB_ROWS, rd->num_rows); y++) {
+		double a_nick = atan((double)(y_off - rd->first_row - y)/rd->radius);
 
-					if (!merged_pixel_set && merged_image) {
-						merged_image->set_pixel(x, r, g, b);
-						merged_pixel_set++;
-					}
-				}
+		memset(row, 0, w * 4 * sizeof(unsigned short));
+		memset(src, 0, w * sizeof(unsigned short));
+
+		for (int x = 0; x < w; x++) {
+			if (rd->st->merged_pixel(rd->m, rd->view_start + x * rd->step_view,
+				a_nick, &r, &g, &b, &s) == 0) {
+				row[x * 4 + 0] = r;
+				row[x * 4 + 1] = g;
+				row[x * 4 + 2] = b;
+				row[x * 4 + 3] = MAX_VALUE;
+				src[x] = s + 1;
 			}
 		}
 
-		if (merged_image)
-			merged_image->next_line();
+		// rows are disjoint, so no lock needed
+		if (rd->img->write_row_at(y, row, OutputImage::RGBA_16) != 0)
+			rd->ret = 1;
+		rd->img->write_sources_at(y, src);
 	}
 
-	if (merged_image)
-		merged_image->done();
+	free(row);
+	free(src);
+}
+
+// As resample(), but rows are computed in parallel and written
+// straight to the mapped file, in whatever order they get done. Only
+// rows first_row up to last_row (excluded) are rendered, -1 means up
+// to h. img gets that size.
+int
+Stitch::resample_raw(ScanImage::mode_t m, RawOutputImage *img,
+	int w, int h, double view_start, double view_end,
+	int first_row, int last_row) {
+	struct raw_data rd;
+
+	view_start = view_start * deg2rad;
+	view_end = view_end * deg2rad;
+
+	if (last_row < 0 || last_row > h)
+		last_row = h;
+	if (first_row < 0 || first_row >= last_row)
+		return 1;
+
+	if (img->init(w, last_row - first_row) != 0)
+		return 1;
+
+	rd.st = this;
+	rd.m = m;
+	rd.img = img;
+	rd.w = w;
+	rd.h = h;
+	rd.first_row = first_row;
+	rd.num_rows = last_row - first_row;
+	rd.view_start = view_start;
+	rd.step_view = (view_end - view_start) / w;
+	rd.radius = (double) w / (view_end -view_start);
+	rd.ret = 0;
+
+	Parallel::run((rd.num_rows + RAW_JOB_ROWS - 1) / RAW_JOB_ROWS, raw_job, &rd);
+
+	if (img->done() != 0)
+		rd.ret = 1;
+
+	return rd.ret;
+}
+
+static int
+comp_first_row(const void *p1, const void *p2) {
+	return (*(RawInputImage **) p1)->get_first_row() -
+		(*(RawInputImage **) p2)->get_first_row();
+}
+
+// The shards must cover the whole image without gaps or overlap. The
+// pixels are copied, nothing is resampled.
+int
+Stitch::merge(RawInputImage **shards, int num_shards) {
+	RowQueue *queue;
+	int w, h, next = 0;
+	int ret = 0;
+
+	if (num_shards <= 0 || !merged_image)
+		return 1;
+
+	qsort(shards, num_shards, sizeof(RawInputImage *), comp_first_row);
+
+	w = shards[0]->w();
+	h = shards[0]->get_full_height();
+
+	for (int i = 0; i < num_shards; i++) {
+		if (shards[i]->w() != w || shards[i]->get_full_height() != h) {
+			fprintf(stderr, "%s: size does not match %s\n",
+				shards[i]->get_file(), shards[0]->get_file());
+			return 1;
+		}
+
+		if (shards[i]->get_first_row() < next) {
+			fprintf(stderr, "%s: rows %d to %d overlap %s\n",
+				shards[i]->get_file(), shards[i]->get_first_row(),
+				std::min(next, shards[i]->get_first_row() +
+				shards[i]->h()) - 1, shards[i - 1]->get_file());
+			return 1;
+		} else if (shards[i]->get_first_row() > next) {
+			fprintf(stderr, "%s: rows %d to %d missing\n",
+				shards[i]->get_file(), next,
+				shards[i]->get_first_row() - 1);
+			return 1;
+		}
+
+		next += shards[i]->h();
+	}
+
+	// no shard reaches beyond h, see RawInputImage::load()
+	if (next != h) {
+		fprintf(stderr, "rows %d to %d missing\n", next, h - 1);
+		return 1;
+	}
+
+	if (merged_image->init(w, h) != 0)
+		return 1;
+
+	queue = new RowQueue(merged_image, OutputImage::RGBA_16,
+		w * 4 * sizeof(unsigned short));
+	queue->start();
+
+	for (int i = 0; i < num_shards; i++) {
+		for (int y = 0; y < shards[i]->h(); y++) {
+			shards[i]->get_row(y, (unsigned short *) queue->get_row());
+			queue->put_row();
+		}
+	}
+
+	ret = queue->finish();
+	delete queue;
+
+	if (merged_image->done() != 0)
+		ret = 1;
+
+	return ret;
+}
+
+// One sample per pixel, taken at its center in the full resolution
+// panorama. Only the pixels of the region are computed, so zoomed out
+// tiles are cheap. Safe to call from several threads.
+int
+Stitch::render_region(ScanImage::mode_t m, int w, int h,
+	double view_start, double view_end, int shift,
+	int x0, int y0, int tw, int th, unsigned char *rgb) {
+
+	view_start = view_start * deg2rad;
+	view_end = view_end * deg2rad;
+
+	double step_view = (view_end - view_start) / w;
+	double scale = ldexp(1.0, shift);
+	int y_off = h / 2;
+	double radius = (double) w / (view_end -view_start);
+	int r, g, b;
+
+	memset(rgb, 0, (size_t) tw * th * 3);
+
+	for (int y = 0; y < th; y++) {
+		double a_nick = atan((y_off - (y0 + y + 0.5) * scale) / radius);
+		unsigned char *p = rgb + (size_t) y * tw * 3;
+
+		for (int x = 0; x < tw; x++) {
+			double a_view = view_start + (x0 + x + 0.5) * scale * step_view;
+
+			if (merged_pixel(m, a_view, a_nick, &r, &g, &b) == 0) {
+				p[x * 3 + 0] = r / 255;
+				p[x * 3 + 1] = g / 255;
+				p[x * 3 + 2] = b / 255;
+			}
+		}
+	}
 
 	return 0;
 }
+
+int
+Stitch::label_tiles(TileOutputImage *tiles, const char *data_file,
+	double visibility,
+	int w, int h, double view_start, double view_end) {
+
+	view_start = view_start * deg2rad;
+	view_end = view_end * deg2rad;
+
+	double step_view = (view_end - view_start) / w;
+	int y_off = h / 2;
+	double radius = (double) w / (view_end -view_start);
+	Hills done(true, true);
+
+	// one catalog for all images
+	if (!catalog) {
+		catalog = new Sites();
+		if (catalog->load(data_file) != 0) {
+			fprintf(stderr, "Could not load datafile %s\n", data_file);
+			catalog->clobber();
+			delete catalog;
+			catalog = NULL;
+			return 1;
+		}
+
+		for (int i = 0; i < num_pics; i++)
+			gipf[i]->add_hills(catalog);
+	}
+
+	for (int i = 0; i < num_pics; i++) {
+		Hills hills;
+
+		gipf[i]->set_height_dist_ratio(visibility);
+		gipf[i]->get_export_hills(&hills);
+
+		for (int j = 0; j < hills.get_num(); j++) {
+			Hill *m = hills.get(j);
+			double a = m->alph;
+			double x, y;
+
+			// Images overlap, take each site once.
+			if (done.contains(m))
+				continue;
+
+			while (a < view_start)
+				a += 2.0 * pi_d;
+			while (a >= view_start + 2.0 * pi_d)
+				a -= 2.0 * pi_d;
+
+			x = (a - view_start) / step_view;
+			y = y_off - radius * tan(m->a_nick);
+			if (x < 0.0 || x >= w || y < 0.0 || y >= h)
+				continue;
+
+			tiles->add_label(m->site->name, (int) rint(m->site->height),
+				x, y, (int) rint(gipf[i]->get_real_distance(m)));
+			done.add(m);
+		}
+	}
+
+	return 0;
+}
+
+// Sample the first image that covers a_view, a_nick. Its number is
+// stored in src if given.
+int
+Stitch::merged_pixel(ScanImage::mode_t m, double a_view, double a_nick,
+	int *r, int *g, int *b, int *src) {
+
+	for (int i = 0; i < num_pics; i++) {
+		if (gipf[i]->get_pixel(m, a_view, a_nick, r, g, b) == 0) {
+			*r = std::max(std::min(*r, MAX_VALUE), 0);
+			*g = std::max(std::min(*g, MAX_VALUE), 0);
+			*b = std::max(std::min(*b, MAX_VALUE), 0);
+			if (src)
+				*src = i;
+
+			return 0;
+		}
+	}
+
+	return 1;
+}
@@ -7,69 +7,148 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <zlib.h>
 
+#include "Parallel.H"
 #include "TIFFOutputImage.H"
 
+#define STRIP_BYTES   (1 << 20)
+// Deflate hardly ever grows data, leave room for tags and offsets.
+#define BIGTIFF_LIMIT (4000000000ULL)
+
 TIFFOutputImage::TIFFOutputImage(const char *f, int b) : OutputImage () {
 	bitspersample = (b==16)?16:8;
+	alpha = true;
+	rows_per_strip = 0;
+	strips = NULL;
+	num_strips = 0;
+	row = NULL;
 	file = strdup(f);
 	tiff = NULL;
-	row = NULL;
 }
 
 TIFFOutputImage::~TIFFOutputImage() {
-	if (row)
-		free(row);
+	free_strips();
+
+	if (tiff)
+		TIFFClose(tiff);
 
 	if (file)
 		free(file);
 }
 
+void
+TIFFOutputImage::set_alpha(bool a) {
+	alpha = a;
+}
+
+void
+TIFFOutputImage::set_rows_per_strip(int n) {
+	rows_per_strip = std::max(n, 0);
+}
+
+void
+TIFFOutputImage::free_strips() {
+	for (int i = 0; i < num_strips; i++) {
+		free(strips[i].raw);
+		free(strips[i].packed);
+	}
+
+	if (strips)
+		free(strips);
+	strips = NULL;
+	num_strips = 0;
+	row = NULL;
+}
+
 int
 TIFFOutputImage::init_internal() {
-	if (row)
-		free(row);
-	row = NULL;
+	int samples = alpha ? 4 : 3;
+	int total_strips;
+	unsigned long long size;
 
-	row = (unsigned char*) calloc((bitspersample / 8) * 4 * W, sizeof(char));
-	if (!row) {
-		perror("calloc");
-		return 1;
+	free_strips();
+
+	line_bytes = W * samples * (bitspersample / 8);
+	if (rows_per_strip > 0)
+		strip_rows = std::min(rows_per_strip, H);
+	else
+		strip_rows = std::max(std::min(STRIP_BYTES / line_bytes, H), 1);
+
+	total_strips = (H + strip_rows - 1) / strip_rows;
+	num_strips = std::max(std::min(Parallel::num_cpus(), total_strips), 1);
+	strips = (strip_t *) calloc(num_strips, sizeof(strip_t));
+
+	for (int i = 0; i < num_strips; i++) {
+		strip_t *s = &strips[i];
+
+		s->bytes_per_sample = bitspersample / 8;
+		s->samples = samples;
+		s->line_bytes = line_bytes;
+		s->cap_packed = compressBound((unsigned long) strip_rows * line_bytes);
+		s->raw = (unsigned char *) malloc((size_t) strip_rows * line_bytes);
+		s->packed = (unsigned char *) malloc(s->cap_packed);
+		if (!s->raw || !s->packed) {
+			perror("malloc");
+			free_strips();
+			return 1;
+		}
 	}
 
+	cur_strip = 0;
+	cur_row = 0;
+	next_strip = 0;
+	row = strips[0].raw;
+	memset(row, 0, line_bytes);
+
 	if (tiff)
 		TIFFClose(tiff);
 
-	if ((tiff = TIFFOpen(file, "w")) == NULL){
+	size = (unsigned long long) line_bytes * H;
+	if ((tiff = TIFFOpen(file, size > BIGTIFF_LIMIT ? "w8" : "w")) == NULL){
 		fprintf(stderr, "can't open %s\n", file);
+		free_strips();
 		return 1;
 	}
 
 	TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, W);
 	TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, H);
-	TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_DEFLATE);
+	TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+	TIFFSetField(tiff, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
 	TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 	TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-	TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, 1);
+	TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, strip_rows);
 	TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, bitspersample);
-	TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 4);
+	TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, samples);
+	if (alpha) {
+		uint16 extra = EXTRASAMPLE_UNASSALPHA;
+		TIFFSetField(tiff, TIFFTAG_EXTRASAMPLES, 1, &extra);
+	}
 
 	return 0;
 }
 
 int
 TIFFOutputImage::set_pixel_internal(int x, int r, int g, int b) {
+	int samples = alpha ? 4 : 3;
+
+	if (!row)
+		return 1;
+
 	if (bitspersample == 8) {	
-		row[x*4+0] = (unsigned char) (r / 255);
-		row[x*4+1] = (unsigned char) (g / 255);
-		row[x*4+2] = (unsigned char) (b / 255);
-		row[x*4+3] = 255;
+		row[x*samples+0] = (unsigned char) (r / 255);
+		row[x*samples+1] = (unsigned char) (g / 255);
+		row[x*samples+2] = (unsigned char) (b / 255);
+		if (alpha)
+			row[x*4+3] = 255;
 	} else if (bitspersample == 16) {
 		unsigned short *row16 = (unsigned short*) row;
-		row16[x*4+0] = (unsigned short) r;
-		row16[x*4+1] = (unsigned short) g;
-		row16[x*4+2] = (unsigned short) b;
-		row16[x*4+3] = 65025;
+		row16[x*samples+0] = (unsigned short) r;
+		row16[x*samples+1] = (unsigned short) g;
+		row16[x*samples+2] = (unsigned short) b;
+		if (alpha)
+			row16[x*4+3] = 65025;
 	}
 
 	return 0;
@@ -77,21 +156,116 @@ TIFFOutputImage::set_pixel_internal(int x, int r, int g, int b) {
 
 int
 TIFFOutputImage::next_line_internal() {
-	TIFFWriteEncodedStrip(tiff, line - 1 , row, W * (bitspersample / 8) * 4);
+	return end_row();
+}
+
+int
+TIFFOutputImage::write_row_internal(const void *r, row_format_t fmt) {
+	if (!row)
+		return 1;
+
+	if (bitspersample == 8)
+		convert_row(r, fmt, row, alpha ? 4 : 3, W);
+	else
+		convert_row(r, fmt, (unsigned short *) row, alpha ? 4 : 3, W);
+
+	line++;
+
+	return end_row();
+}
+
+// Move on to the next row once line is complete, flushing full strips.
+int
+TIFFOutputImage::end_row() {
+	if (!row)
+		return 1;
+
+	if (++cur_row == strip_rows || line >= H) {
+		strips[cur_strip].raw_len = (unsigned long) cur_row * line_bytes;
+		cur_strip++;
+		cur_row = 0;
+
+		if ((cur_strip == num_strips || line >= H) && flush() != 0) {
+			free_strips();
+			return 1;
+		}
+	}
+
+	row = strips[cur_strip].raw + (size_t) cur_row * line_bytes;
+	memset(row, 0, line_bytes);
+
+	return 0;
+}
+
+// Apply the horizontal predictor and deflate strip n.
+void
+TIFFOutputImage::compress_job(int n, void *data) {
+	strip_t *s = &((TIFFOutputImage *) data)->strips[n];
+	int rows = s->raw_len / s->line_bytes;
+	int samples_per_row = s->line_bytes / s->bytes_per_sample;
+	uLongf len = s->cap_packed;
+
+	for (int y = 0; y < rows; y++) {
+		unsigned char *r = s->raw + (size_t) y * s->line_bytes;
+
+		if (s->bytes_per_sample == 1) {
+			for (int i = samples_per_row - 1; i >= s->samples; i--)
+				r[i] -= r[i - s->samples];
+		} else {
+			unsigned short *r16 = (unsigned short *) r;
+
+			for (int i = samples_per_row - 1; i >= s->samples; i--)
+				r16[i] -= r16[i - s->samples];
+		}
+	}
+
+	s->ok = compress2(s->packed, &len, s->raw, s->raw_len,
+		Z_DEFAULT_COMPRESSION) == Z_OK;
+	s->packed_len = len;
+}
+
+int
+TIFFOutputImage::flush() {
+	int n = cur_strip;
+
+	cur_strip = 0;
+
+	Parallel::run(n, compress_job, this);
+
+	for (int i = 0; i < n; i++) {
+		if (!strips[i].ok) {
+			fprintf(stderr, "%s: compression failed\n", file);
+			return 1;
+		}
+
+		if (TIFFWriteRawStrip(tiff, next_strip++, strips[i].packed,
+			strips[i].packed_len) < 0) {
+			fprintf(stderr, "%s: write failed\n", file);
+			return 1;
+		}
+	}
 
-	memset(row, 0, (bitspersample / 8) * 4 * W * sizeof(char));
 	return 0;
 }
 
 int
 TIFFOutputImage::done_internal() {
+	int ret = 0;
+
+	// rows of a strip not completed by next_line()
+	if (row && cur_row > 0) {
+		strips[cur_strip].raw_len = (unsigned long) cur_row * line_bytes;
+		cur_strip++;
+	}
+
+	if (row && cur_strip > 0)
+		ret = flush();
+
 	if (tiff)
 		TIFFClose(tiff);
 	tiff = NULL;
 
-	if (row)
-		free(row);
-	row = NULL;
+	free_strips();
 
-	return 0;
-}	
+	return ret;
+}
@@ -0,0 +1,94 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "TeeOutputImage.H"
+
+TeeOutputImage::TeeOutputImage() : OutputImage() {
+	sinks = NULL;
+	ok = NULL;
+	num_sinks = 0;
+}
+
+TeeOutputImage::~TeeOutputImage() {
+	if (sinks)
+		free(sinks);
+	if (ok)
+		free(ok);
+}
+
+void
+TeeOutputImage::add(OutputImage *img) {
+	sinks = (OutputImage **) realloc(sinks,
+		(num_sinks + 1) * sizeof(OutputImage *));
+	ok = (bool *) realloc(ok, (num_sinks + 1) * sizeof(bool));
+	sinks[num_sinks] = img;
+	ok[num_sinks] = false;
+	num_sinks++;
+}
+
+int
+TeeOutputImage::init_internal() {
+	int n = 0;
+
+	for (int i = 0; i < num_sinks; i++) {
+		ok[i] = sinks[i]->init(W, H) == 0;
+		if (ok[i])
+			n++;
+	}
+
+	return n > 0 ? 0 : 1;
+}
+
+int
+TeeOutputImage::set_pixel_internal(int x, int r, int g, int b) {
+	int ret = 0;
+
+	for (int i = 0; i < num_sinks; i++)
+		if (ok[i] && sinks[i]->set_pixel(x, r, g, b) != 0)
+			ret = 1;
+
+	return ret;
+}
+
+int
+TeeOutputImage::next_line_internal() {
+	int ret = 0;
+
+	for (int i = 0; i < num_sinks; i++)
+		if (ok[i] && sinks[i]->next_line() != 0)
+			ret = 1;
+
+	return ret;
+}
+
+int
+TeeOutputImage::write_row_internal(const void *row, row_format_t fmt) {
+	int ret = 0;
+
+	for (int i = 0; i < num_sinks; i++)
+		if (ok[i] && sinks[i]->write_row(row, fmt) != 0)
+			ret = 1;
+
+	line++;
+
+	return ret;
+}
+
+int
+TeeOutputImage::done_internal() {
+	int ret = 0;
+
+	for (int i = 0; i < num_sinks; i++) {
+		if (ok[i] && sinks[i]->done() != 0)
+			ret = 1;
+		ok[i] = false;
+	}
+
+	return ret;
+}
@@ -0,0 +1,396 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "JPEGOutputImage.H"
+#include "TileOutputImage.H"
+
+TileOutputImage::TileOutputImage(const char *b, int ts, int q) : OutputImage() {
+	base = strdup(b);
+	tile_size = std::max(ts, 1);
+	quality = q;
+	levels = NULL;
+	num_levels = 0;
+	row = NULL;
+	labels = NULL;
+	num_labels = 0;
+}
+
+TileOutputImage::~TileOutputImage() {
+	free_levels();
+
+	for (int i = 0; i < num_labels; i++)
+		free(labels[i].name);
+	if (labels)
+		free(labels);
+
+	free(base);
+}
+
+void
+TileOutputImage::free_levels() {
+	for (int i = 0; i < num_levels; i++) {
+		level_t *l = &levels[i];
+
+		if (l->tiles) {
+			for (int c = 0; c < l->cols; c++) {
+				if (l->tiles[c].c.err)
+					jpeg_destroy_compress(&l->tiles[c].c);
+				if (l->tiles[c].buf)
+					free(l->tiles[c].buf);
+			}
+			free(l->tiles);
+		}
+
+		free(l->pending);
+		free(l->half);
+		free(l->rgb);
+	}
+
+	if (levels)
+		free(levels);
+	levels = NULL;
+	num_levels = 0;
+
+	if (row)
+		free(row);
+	row = NULL;
+}
+
+void
+TileOutputImage::add_label(const char *name, int height, double x, double y,
+	int dist) {
+	labels = (label_t *) realloc(labels, (num_labels + 1) * sizeof(label_t));
+	labels[num_labels].name = strdup(name);
+	labels[num_labels].height = height;
+	labels[num_labels].dist = dist;
+	labels[num_labels].x = x;
+	labels[num_labels].y = y;
+	num_labels++;
+}
+
+static int
+make_dir(const char *path) {
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		perror(path);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Level 0 is the full image, the coarsest level is 1 x 1 pixel. DZI
+// numbers them the other way round.
+int
+TileOutputImage::init_internal() {
+	size_t len = strlen(base) + 32;
+	char *path = (char *) malloc(len);
+	int ret = 0;
+
+	free_levels();
+
+	num_levels = 1;
+	for (int w = W, h = H; w > 1 || h > 1; w = (w + 1) / 2, h = (h + 1) / 2)
+		num_levels++;
+
+	levels = (level_t *) calloc(num_levels, sizeof(level_t));
+	row = (unsigned short *) calloc(W * 4, sizeof(unsigned short));
+
+	snprintf(path, len, "%s_files", base);
+	ret = make_dir(path);
+
+	for (int i = 0; i < num_levels; i++) {
+		level_t *l = &levels[i];
+
+		l->w = i == 0 ? W : (levels[i - 1].w + 1) / 2;
+		l->h = i == 0 ? H : (levels[i - 1].h + 1) / 2;
+		l->pending = (unsigned short *) malloc(l->w * 4 * sizeof(unsigned short));
+		l->half = (unsigned short *)
+			malloc(((l->w + 1) / 2) * 4 * sizeof(unsigned short));
+		l->rgb = (unsigned char *) malloc(l->w * 3);
+		l->cols = (l->w + tile_size - 1) / tile_size;
+
+		snprintf(path, len, "%s_files/%d", base, num_levels - 1 - i);
+		if (ret == 0)
+			ret = make_dir(path);
+	}
+
+	free(path);
+
+	return ret;
+}
+
+// Average 2 x 2 blocks of r0 and r1, which may be NULL at the bottom
+// edge. Pixels are weighted by alpha, as in ReduceOutputImage.
+void
+TileOutputImage::reduce(const unsigned short *r0, const unsigned short *r1,
+	int w, unsigned short *out) {
+	for (int x = 0; x < (w + 1) / 2; x++) {
+		unsigned long long s[4] = {0, 0, 0, 0};
+		int n = 0;
+
+		for (int dy = 0; dy < 2; dy++) {
+			const unsigned short *r = dy ? r1 : r0;
+
+			if (!r)
+				continue;
+
+			for (int dx = 0; dx < 2 && 2 * x + dx < w; dx++) {
+				const unsigned short *p = r + (2 * x + dx) * 4;
+
+				s[0] += (unsigned long long) p[0] * p[3];
+				s[1] += (unsigned long long) p[1] * p[3];
+				s[2] += (unsigned long long) p[2] * p[3];
+				s[3] += p[3];
+				n++;
+			}
+		}
+
+		if (s[3] == 0) {
+			memset(out + x * 4, 0, 4 * sizeof(unsigned short));
+			continue;
+		}
+
+		out[x * 4 + 0] = (s[0] + s[3] / 2) / s[3];
+		out[x * 4 + 1] = (s[1] + s[3] / 2) / s[3];
+		out[x * 4 + 2] = (s[2] + s[3] / 2) / s[3];
+		out[x * 4 + 3] = std::max((s[3] + n / 2) / n, 1ULL);
+	}
+}
+
+void
+TileOutputImage::start_tiles(int n) {
+	level_t *l = &levels[n];
+	int th = std::min(tile_size, l->h - l->line);
+
+	if (!l->tiles)
+		l->tiles = (tile_t *) calloc(l->cols, sizeof(tile_t));
+
+	for (int c = 0; c < l->cols; c++) {
+		tile_t *t = &l->tiles[c];
+
+		if (!t->c.err) {
+			t->c.err = jpeg_std_error(&t->e);
+			jpeg_create_compress(&t->c);
+			JPEGOutputImage::mem_dest(&t->c, &t->buf, &t->len, &t->cap);
+		}
+
+		t->c.image_width = std::min(tile_size, l->w - c * tile_size);
+		t->c.image_height = th;
+		t->c.input_components = 3;
+		t->c.in_color_space = JCS_RGB;
+		jpeg_set_defaults(&t->c);
+		jpeg_set_quality(&t->c, quality, TRUE);
+		jpeg_start_compress(&t->c, TRUE);
+	}
+}
+
+int
+TileOutputImage::finish_tiles(int n, int ty) {
+	level_t *l = &levels[n];
+	size_t len = strlen(base) + 64;
+	char *path = (char *) malloc(len);
+	int ret = 0;
+
+	for (int c = 0; c < l->cols; c++) {
+		tile_t *t = &l->tiles[c];
+		FILE *fp;
+
+		jpeg_finish_compress(&t->c);
+
+		snprintf(path, len, "%s_files/%d/%d_%d.jpg", base,
+			num_levels - 1 - n, c, ty);
+
+		if ((fp = fopen(path, "wb")) == NULL) {
+			perror(path);
+			ret = 1;
+			continue;
+		}
+
+		if (fwrite(t->buf, t->len, 1, fp) != 1) {
+			perror(path);
+			ret = 1;
+		}
+
+		fclose(fp);
+	}
+
+	free(path);
+
+	return ret;
+}
+
+// Add the next row r of level n, and pass every pair of rows on to
+// level n + 1.
+int
+TileOutputImage::add_row(int n, const unsigned short *r) {
+	level_t *l = &levels[n];
+	int ty = l->line / tile_size;
+	int ret = 0;
+
+	if (l->line >= l->h)
+		return 1;
+
+	if (l->line % tile_size == 0)
+		start_tiles(n);
+
+	convert_row(r, RGBA_16, l->rgb, 3, l->w);
+	for (int c = 0; c < l->cols; c++) {
+		JSAMPROW p = l->rgb + c * tile_size * 3;
+
+		jpeg_write_scanlines(&l->tiles[c].c, &p, 1);
+	}
+
+	l->line++;
+
+	if (l->line % tile_size == 0 || l->line == l->h)
+		ret = finish_tiles(n, ty);
+
+	if (n + 1 < num_levels) {
+		if (!l->have_pending && l->line < l->h) {
+			memcpy(l->pending, r, l->w * 4 * sizeof(unsigned short));
+			l->have_pending = true;
+		} else {
+			if (l->have_pending)
+				reduce(l->pending, r, l->w, l->half);
+			else
+				reduce(r, NULL, l->w, l->half);
+
+			l->have_pending = false;
+			if (add_row(n + 1, l->half) != 0)
+				ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+int
+TileOutputImage::set_pixel_internal(int x, int r, int g, int b) {
+	if (!row)
+		return 1;
+
+	row[x * 4 + 0] = r;
+	row[x * 4 + 1] = g;
+	row[x * 4 + 2] = b;
+	row[x * 4 + 3] = 65025;
+
+	return 0;
+}
+
+int
+TileOutputImage::next_line_internal() {
+	int ret;
+
+	if (!row)
+		return 1;
+
+	ret = add_row(0, row);
+	memset(row, 0, W * 4 * sizeof(unsigned short));
+
+	return ret;
+}
+
+int
+TileOutputImage::write_row_internal(const void *r, row_format_t fmt) {
+	if (!row)
+		return 1;
+
+	convert_row(r, fmt, row, 4, W);
+	line++;
+
+	return next_line_internal();
+}
+
+int
+TileOutputImage::write_dzi() {
+	size_t len = strlen(base) + 8;
+	char *path = (char *) malloc(len);
+	FILE *fp;
+
+	snprintf(path, len, "%s.dzi", base);
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror(path);
+		free(path);
+		return 1;
+	}
+
+	fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+		"  Format=\"jpg\" Overlap=\"0\" TileSize=\"%d\">\n"
+		"  <Size Width=\"%d\" Height=\"%d\"/>\n"
+		"</Image>\n", tile_size, W, H);
+
+	fclose(fp);
+	free(path);
+
+	return 0;
+}
+
+int
+TileOutputImage::write_labels() {
+	size_t len = strlen(base) + 32;
+	char *path = (char *) malloc(len);
+	int ret = 0;
+
+	for (int i = 0; i < num_levels && num_labels > 0; i++) {
+		double scale = ldexp(1.0, -i);
+		FILE *fp;
+
+		snprintf(path, len, "%s_files/%d/hills", base, num_levels - 1 - i);
+		fp = fopen(path, "w");
+		if (!fp) {
+			perror(path);
+			ret = 1;
+			break;
+		}
+
+		fprintf(fp, "#\n# name\theight\tx\ty\tdistance\tflags\n#\n");
+
+		for (int j = 0; j < num_labels; j++)
+			fprintf(fp, "%s\t%d\t%d\t%d\t%d\n", labels[j].name,
+				labels[j].height,
+				std::min((int) rint(labels[j].x * scale), levels[i].w - 1),
+				std::min((int) rint(labels[j].y * scale), levels[i].h - 1),
+				labels[j].dist);
+
+		fclose(fp);
+	}
+
+	free(path);
+
+	return ret;
+}
+
+int
+TileOutputImage::done_internal() {
+	int ret = 0;
+
+	if (!row)
+		return 1;
+
+	// An incomplete image is padded, so all tiles get finished.
+	memset(row, 0, W * 4 * sizeof(unsigned short));
+	while (levels[0].line < H)
+		if (add_row(0, row) != 0)
+			ret = 1;
+
+	if (write_dzi() != 0 || write_labels() != 0)
+		ret = 1;
+
+	free_levels();
+
+	return ret;
+}
@@ -0,0 +1,427 @@
+//
+// Copyright 2026 agent <agent@local>
+//
+// This software may be used and distributed according to the terms
+// of the GNU General Public License, incorporated herein by reference.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+#include "Stitch.H"
+#include "Parallel.H"
+#include "JPEGOutputImage.H"
+#include "TileServer.H"
+
+#define TILE_SIZE    256
+#define MAX_REQUEST  4096
+#define MAX_THREADS  64
+#define READ_TIMEOUT 10  // seconds for the request line
+
+TileServer::TileServer(Stitch *s, ScanImage::mode_t m, int w, int h,
+	double from, double to, int n) {
+	st = s;
+	mode = m;
+	W = w;
+	H = h;
+	view_start = from;
+	view_end = to;
+	tile_size = TILE_SIZE;
+	cache_size = std::max(n, 1);
+	cache = (entry_t *) calloc(cache_size, sizeof(entry_t));
+	clock = 0;
+	fd = -1;
+	pthread_mutex_init(&lock, NULL);
+
+	// same levels as TileOutputImage
+	num_levels = 1;
+	for (int lw = W, lh = H; lw > 1 || lh > 1;
+		lw = (lw + 1) / 2, lh = (lh + 1) / 2)
+		num_levels++;
+}
+
+TileServer::~TileServer() {
+	for (int i = 0; i < cache_size; i++)
+		if (cache[i].jpeg)
+			free(cache[i].jpeg);
+	free(cache);
+
+	if (fd >= 0)
+		close(fd);
+
+	pthread_mutex_destroy(&lock);
+}
+
+void
+TileServer::level_size(int level, int *w, int *h) {
+	*w = W;
+	*h = H;
+
+	for (int i = num_levels - 1; i > level; i--) {
+		*w = (*w + 1) / 2;
+		*h = (*h + 1) / 2;
+	}
+}
+
+// Copy a cached tile to a new buffer, so it may be evicted meanwhile.
+int
+TileServer::lookup(int level, int x, int y, unsigned char **jpeg,
+	unsigned long *len) {
+	int ret = 1;
+
+	pthread_mutex_lock(&lock);
+
+	for (int i = 0; i < cache_size; i++) {
+		entry_t *e = &cache[i];
+
+		if (e->jpeg && e->level == level && e->x == x && e->y == y) {
+			e->used = ++clock;
+			*jpeg = (unsigned char *) malloc(e->len);
+			memcpy(*jpeg, e->jpeg, e->len);
+			*len = e->len;
+			ret = 0;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+// Replace the least recently used entry. The cache is small compared
+// to the cost of rendering a tile, so a linear search will do.
+void
+TileServer::insert(int level, int x, int y, const unsigned char *jpeg,
+	unsigned long len) {
+	entry_t *lru = &cache[0];
+
+	pthread_mutex_lock(&lock);
+
+	for (int i = 0; i < cache_size; i++) {
+		entry_t *e = &cache[i];
+
+		if (e->jpeg && e->level == level && e->x == x && e->y == y) {
+			// rendered by another thread meanwhile
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+
+		if (!e->jpeg || (lru->jpeg && e->used < lru->used))
+			lru = e;
+	}
+
+	if (lru->jpeg)
+		free(lru->jpeg);
+
+	lru->level = level;
+	lru->x = x;
+	lru->y = y;
+	lru->jpeg = (unsigned char *) malloc(len);
+	memcpy(lru->jpeg, jpeg, len);
+	lru->len = len;
+	lru->used = ++clock;
+
+	pthread_mutex_unlock(&lock);
+}
+
+int
+TileServer::render(int level, int x, int y, unsigned char **jpeg,
+	unsigned long *len) {
+	struct jpeg_compress_struct c;
+	struct jpeg_error_mgr e;
+	unsigned char *rgb;
+	unsigned long cap = 0;
+	int lw, lh, tw, th;
+
+	level_size(level, &lw, &lh);
+	if (x < 0 || y < 0 || x >= (lw + tile_size - 1) / tile_size ||
+		y >= (lh + tile_size - 1) / tile_size)
+		return 1;
+
+	tw = std::min(tile_size, lw - x * tile_size);
+	th = std::min(tile_size, lh - y * tile_size);
+
+	rgb = (unsigned char *) malloc((size_t) tw * th * 3);
+	st->render_region(mode, W, H, view_start, view_end,
+		num_levels - 1 - level, x * tile_size, y * tile_size, tw, th, rgb);
+
+	*jpeg = NULL;
+	c.err = jpeg_std_error(&e);
+	jpeg_create_compress(&c);
+	JPEGOutputImage::mem_dest(&c, jpeg, len, &cap);
+	c.image_width = tw;
+	c.image_height = th;
+	c.input_components = 3;
+	c.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&c);
+	jpeg_set_quality(&c, 90, TRUE);
+	jpeg_start_compress(&c, TRUE);
+
+	for (int i = 0; i < th; i++) {
+		JSAMPROW r = rgb + (size_t) i * tw * 3;
+		jpeg_write_scanlines(&c, &r, 1);
+	}
+
+	jpeg_finish_compress(&c);
+	jpeg_destroy_compress(&c);
+	free(rgb);
+
+	return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len) {
+	const char *p = (const char *) buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void
+respond(int fd, int status, const char *reason, const char *type,
+	const void *body, unsigned long len) {
+	char head[256];
+
+	snprintf(head, sizeof(head),
+		"HTTP/1.0 %d %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %lu\r\n"
+		"Connection: close\r\n"
+		"\r\n", status, reason, type, len);
+
+	if (write_all(fd, head, strlen(head)) == 0 && len > 0)
+		write_all(fd, body, len);
+}
+
+static void
+respond_error(int fd, int status, const char *reason) {
+	char body[64];
+
+	snprintf(body, sizeof(body), "%d %s\n", status, reason);
+	respond(fd, status, reason, "text/plain", body, strlen(body));
+}
+
+// Parse /pano_files/<level>/<x>_<y>.jpg, rejecting numbers outside of
+// the pyramid before they are used for any computation.
+int
+TileServer::parse_tile(const char *path, long *level, long *x, long *y) {
+	const char *prefix = "/pano_files/";
+	const char *p = path + strlen(prefix);
+	char *end;
+	int lw, lh;
+
+	if (strncmp(path, prefix, strlen(prefix)) != 0)
+		return 1;
+
+	*level = strtol(p, &end, 10);
+	if (end == p || *end != '/' || *level < 0 || *level >= num_levels)
+		return 1;
+
+	level_size(*level, &lw, &lh);
+
+	p = end + 1;
+	*x = strtol(p, &end, 10);
+	if (end == p || *end != '_' || *x < 0 ||
+		*x >= (lw + tile_size - 1) / tile_size)
+		return 1;
+
+	p = end + 1;
+	*y = strtol(p, &end, 10);
+	if (end == p || strcmp(end, ".jpg") != 0 || *y < 0 ||
+		*y >= (lh + tile_size - 1) / tile_size)
+		return 1;
+
+	return 0;
+}
+
+void
+TileServer::handle(int client) {
+	char req[MAX_REQUEST + 1];
+	char method[8], path[256];
+	size_t len = 0;
+	long level, x, y;
+
+	// only the request line is needed
+	while (len < MAX_REQUEST && !memchr(req, '\n', len)) {
+		ssize_t n = read(client, req + len, MAX_REQUEST - len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		len += n;
+	}
+	req[len] = '\0';
+
+	if (sscanf(req, "%7s %255s", method, path) != 2) {
+		respond_error(client, 400, "Bad Request");
+		return;
+	}
+
+	if (strcmp(method, "GET") != 0) {
+		respond_error(client, 405, "Method Not Allowed");
+		return;
+	}
+
+	if (strcmp(path, "/pano.dzi") == 0) {
+		char dzi[512];
+
+		snprintf(dzi, sizeof(dzi),
+			"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+			"  Format=\"jpg\" Overlap=\"0\" TileSize=\"%d\">\n"
+			"  <Size Width=\"%d\" Height=\"%d\"/>\n"
+			"</Image>\n", tile_size, W, H);
+		respond(client, 200, "OK", "application/xml", dzi, strlen(dzi));
+	} else if (parse_tile(path, &level, &x, &y) == 0) {
+		unsigned char *jpeg;
+		unsigned long jpeg_len;
+
+		if (lookup(level, x, y, &jpeg, &jpeg_len) != 0) {
+			if (render(level, x, y, &jpeg, &jpeg_len) != 0) {
+				respond_error(client, 404, "Not Found");
+				return;
+			}
+
+			insert(level, x, y, jpeg, jpeg_len);
+		}
+
+		respond(client, 200, "OK", "image/jpeg", jpeg, jpeg_len);
+		free(jpeg);
+	} else {
+		respond_error(client, 404, "Not Found");
+	}
+}
+
+int
+TileServer::listen(const char *addr) {
+	if (addr[0] == '/' || addr[0] == '.') {
+		struct sockaddr_un un;
+		struct stat sb;
+
+		if (strlen(addr) >= sizeof(un.sun_path)) {
+			fprintf(stderr, "%s: path too long\n", addr);
+			return 1;
+		}
+
+		// a stale socket of a previous run
+		if (stat(addr, &sb) == 0 && S_ISSOCK(sb.st_mode))
+			unlink(addr);
+
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strcpy(un.sun_path, addr);
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *) &un, sizeof(un)) != 0) {
+			perror(addr);
+			return 1;
+		}
+	} else {
+		struct sockaddr_in sin;
+		int on = 1;
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(atoi(addr));
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (fd < 0 || bind(fd, (struct sockaddr *) &sin, sizeof(sin)) != 0) {
+			perror(addr);
+			return 1;
+		}
+	}
+
+	if (::listen(fd, 64) != 0) {
+		perror("listen");
+		return 1;
+	}
+
+	return 0;
+}
+
+void *
+TileServer::worker_main(void *p) {
+	TileServer *ts = (TileServer *) p;
+
+	for (;;) {
+		int client = accept(ts->fd, NULL, NULL);
+		struct timeval tv;
+
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+
+		// an idle client must not block the worker
+		tv.tv_sec = READ_TIMEOUT;
+		tv.tv_usec = 0;
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		ts->handle(client);
+		close(client);
+	}
+
+	return NULL;
+}
+
+int
+TileServer::run(int num_threads) {
+	pthread_t threads[MAX_THREADS];
+	int started = 0;
+
+	if (fd < 0)
+		return 1;
+
+	// clients closing early must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	if (num_threads <= 0)
+		num_threads = Parallel::num_cpus();
+	num_threads = std::min(num_threads, MAX_THREADS);
+
+	// The calling thread works as well.
+	for (int i = 0; i < num_threads - 1; i++) {
+		if (pthread_create(&threads[started], NULL, worker_main, this) != 0) {
+			perror("pthread_create");
+			break;
+		}
+		started++;
+	}
+
+	worker_main(this);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	return 1;
+}
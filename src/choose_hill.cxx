@@ -24,7 +24,7 @@ choose_hill(const Hills *hills, const char *l) {
 		if (m->flags & (Hill::DUPLIC | Hill::TRACK_POINT))
 			continue;
 
-		snprintf(buf, sizeof(buf) - 1, "%s (%dm)", m->name, (int) m->height);
+		snprintf(buf, sizeof(buf) - 1, "%s (%dm)", m->site->name, (int) m->site->height);
 		buf[sizeof(buf) - 1] = '\0';
 		sc->add(buf, m);
 	} 
@@ -7,10 +7,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <libgen.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/param.h>
 #include <math.h>
 #include <assert.h>
 #include <algorithm>
@@ -34,9 +36,15 @@
 #include "GipfelWidget.H"
 #include "JPEGOutputImage.H"
 #include "TIFFOutputImage.H"
+#include "RawOutputImage.H"
+#include "RawInputImage.H"
+#include "ReduceOutputImage.H"
+#include "TileOutputImage.H"
+#include "TileServer.H"
 #include "PreviewOutputImage.H"
 #include "Stitch.H"
 #include "ScreenDump.H"
+#include "ControlPoints.H"
 #include "choose_hill.H"
 #include "../config.h"
 
@@ -64,13 +72,31 @@ static Fl_Menu_Bar *mb;
 #define STITCH_PREVIEW           1
 #define STITCH_JPEG              2
 #define STITCH_TIFF              4
-
-static int stitch(ScanImage::mode_t m , int b_16,
+#define STITCH_RAW               8
+#define STITCH_THUMB            16
+#define STITCH_TILES            32
+#define STITCH_SERVE            64
+
+typedef struct {
+	const char *jpeg, *tiff, *raw, *thumb, *tiles, *serve;
+	int thumb_factor;
+	double visibility;
+	int shard, num_shards;  // band shard of num_shards, if num_shards > 0
+} stitch_outputs_t;
+
+static int stitch(ScanImage::mode_t m , int b_16, int alpha, int strip_rows,
 	int stitch_w, int stitch_h,
-	double from, double to, int type, const char *path, int argc, char **argv);
+	double from, double to, int type, const stitch_outputs_t *outputs,
+	int argc, char **argv);
+static int merge(int b_16, int alpha, int strip_rows, int type,
+	const stitch_outputs_t *outputs, int argc, char **argv);
 
 static int export_hills(const char *export_file, double visibility);
 static int export_position();
+static int calibrate(const char *control_file, const char *result_file,
+	int robust);
+static int annotate(const char *dir, double visibility,
+	int argc, char **argv);
 
 static int
 confirm_overwrite(const char *f) {
@@ -211,7 +237,11 @@ void track_width_cb(Fl_Value_Input* o, void*) {
 }
 
 void viewpoint_cb(Fl_Value_Input* o, void*) {
-	Hill *m = choose_hill(gipf->get_mountains(), "Choose Viewpoint");
+	Hills mnts;
+	Hill *m;
+
+	gipf->get_mountains(&mnts);
+	m = choose_hill(&mnts, "Choose Viewpoint");
 	if (m) {
 		gipf->set_viewpoint(m);
 		set_values();
@@ -229,6 +259,31 @@ void hidden_cb(Fl_Menu_* o, void*d) {
 	gipf->set_show_hidden(o->mvalue()->value() != 0); 
 }
 
+void outliers_cb(Fl_Menu_* o, void*d) {
+	gipf->set_reject_outliers(o->mvalue()->value() != 0);
+}
+
+void zoom_cb(Fl_Widget *, void *d) {
+	int level = gipf->get_zoom_level() + (d ? 1 : -1);
+	double fx, fy;
+
+	if (level < 0 || level >= gipf->get_num_zoom_levels())
+		return;
+
+	// keep the center of the view in place
+	fx = (scroll->xposition() + scroll->w() / 2.0) / gipf->w();
+	fy = (scroll->yposition() + scroll->h() / 2.0) / gipf->h();
+
+	gipf->set_zoom_level(level);
+
+	scroll->position(
+		std::max(0, std::min((int) (fx * gipf->w() - scroll->w() / 2.0),
+			gipf->w() - scroll->w())),
+		std::max(0, std::min((int) (fy * gipf->h() - scroll->h() / 2.0),
+			gipf->h() - scroll->h())));
+	scroll->redraw();
+}
+
 void save_distortion_cb(Fl_Widget *, void *) {
 	char buf[1024];
 	const char * prof_name;
@@ -322,8 +377,15 @@ void fill_menubar(Fl_Menu_Bar* mb) {
 	mb->add("&Distortion/Load Profile", 0, (Fl_Callback *)load_distortion_cb);
 	mb->add("&Distortion/Save Profile", 0, (Fl_Callback *)save_distortion_cb);
 
+	mb->add("&View/Zoom &In", FL_CTRL+'+', (Fl_Callback *) zoom_cb,
+		(void *)0);
+	mb->add("&View/Zoom &Out", FL_CTRL+'-', (Fl_Callback *) zoom_cb,
+		(void *)1);
+
 	mb->add("&Option/Show Hidden", 0, (Fl_Callback *) hidden_cb, 
 		(void *)0, FL_MENU_TOGGLE);
+	mb->add("&Option/Reject Outliers", 0, (Fl_Callback *) outliers_cb, 
+		(void *)0, FL_MENU_TOGGLE);
 
 	mb->add("&Help/Readme", 0, (Fl_Callback*)readme_cb);
 	mb->add("&Help/About", 0, (Fl_Callback*)about_cb);
@@ -332,8 +394,12 @@ void fill_menubar(Fl_Menu_Bar* mb) {
 void usage() {
 	fprintf(stderr,
 		"usage: gipfel [-v <viewpoint>] [-d <file>]\n"
-		"          [-s] [-j <file>] [-t <dir] [-w <width>] [-h <height>]\n"
-		"          [-e <file>] [-E] [-p]\n"
+		"          [-s] [-j <file>] [-t <dir] [-m <file>] [-T <file>] [-f <n>]\n"
+		"          [-z <name>] [-L <port>] [-w <width>] [-h <height>]\n"
+		"          [--shard <i>/<n>] [--merge]\n"
+		"          [-4] [-n] [-S <rows>]\n"
+		"          [-e <file>] [-E] [-p] [-c <file> [-o <file>] [-R]]\n"
+		"          [-a <dir>]\n"
 		"          [<image(s)>]\n"
 		"   -v <viewpoint>  Set point from which the picture was taken.\n"
 		"                   This must be a string that unambiguously \n"
@@ -342,16 +408,42 @@ void usage() {
 		"   -V <visibility> Set initial visibility.\n"
 		"   -u <k0>,<k1>    Use distortion correction values k0,k1.\n"
 		"   -s              Stitch mode.\n"
-		"   -4              Create 16bit output (only with TIFF stitching).\n"
+		"   -4              Create 16bit output (only with TIFF or raw\n"
+		"                   stitching).\n"
+		"   -n              No alpha channel (only with TIFF or raw\n"
+		"                   stitching).\n"
+		"   -S <rows>       Rows per strip of TIFF output.\n"
 		"   -r <from>,<to>  Stitch range in degrees (e.g. 100.0,200.0).\n"
 		"   -b              Use bicubic interpolation for stitching.\n"
 		"   -w <width>      Width of result image.\n"
 		"   -h <height>     Height of result image.\n"
 		"   -j <file>       JPEG output file in Stitch mode.\n"
 		"   -t <file>       TIFF output file in Stitch mode.\n"
+		"   -m <file>       Memory mapped raw output file in Stitch mode.\n"
+		"   -T <file>       JPEG thumbnail output file in Stitch mode.\n"
+		"   -f <n>          Thumbnail is <n> times smaller (default 8).\n"
+		"   -z <name>       Deep zoom tiles <name>.dzi and <name>_files\n"
+		"                   with hill labels in Stitch mode.\n"
+		"   -L <port>       Serve deep zoom tiles of the stitched image\n"
+		"                   on localhost:<port>/pano.dzi, or on a Unix\n"
+		"                   socket if <port> is a path.\n"
+		"                   Output options can be combined to create\n"
+		"                   several files in one pass.\n"
+		"   --shard <i>/<n> Only stitch band <i> of <n> horizontal bands\n"
+		"                   (0 <= <i> < <n>) to the -m file.\n"
+		"   --merge         Assemble the -m files of all bands given\n"
+		"                   instead of images into the outputs, e.g.\n"
+		"                   gipfel --merge -j out.jpg part*.raw\n"
 		"   -p              Export position of image to stdout.\n"
 		"   -e <file>       Export positions of hills from <file> on image.\n"
 		"   -E              Export hills from default data file.\n"
+		"   -c <file>       Calibrate images using control points from\n"
+		"                   <file> (lines of image,hill,x,y) and store\n"
+		"                   the results in the images.\n"
+		"   -o <file>       Write calibration results to <file> instead.\n"
+		"   -R              Reject control points that don't fit.\n"
+		"   -a <dir>        Write copies of the images with the hills\n"
+		"                   drawn in to <dir>. No display is needed.\n"
 		"      <image(s)>   JPEG file(s) to use.\n");
 }
 
@@ -478,17 +570,28 @@ int main(int argc, char** argv) {
 	char *view_point = NULL;
 	int err, my_argc, sx, sy, sw, sh;
 	int stitch_flag = 0, stitch_w = 2000, stitch_h = 500;
-	int jpeg_flag = 0, tiff_flag = 0, distortion_flag = 0, position_flag = 0;
-	int export_flag = 0;
-	int bicubic_flag = 0, b_16_flag = 0;
+	int distortion_flag = 0, position_flag = 0;
+	int export_flag = 0, robust_flag = 0;
+	int bicubic_flag = 0, b_16_flag = 0, no_alpha_flag = 0, strip_rows = 0;
 	double stitch_from = 0.0, stitch_to = 380.0;
 	double dist_k0 = 0.0, dist_k1 = 0.0, dist_x0 = 0.0;
 	double visibility = 0.07;
-	const char *outpath = "/tmp";
+	stitch_outputs_t stitch_outputs = {NULL, NULL, NULL, NULL, NULL, NULL,
+		8, 0.0, 0, 0};
+	int merge_flag = 0, type = 0;
+	static struct option long_options[] = {
+		{"shard", required_argument, NULL, 'K'},
+		{"merge", no_argument, NULL, 'M'},
+		{NULL, 0, NULL, 0}
+	};
 	const char *export_file = NULL;
+	const char *control_file = NULL, *result_file = NULL;
+	const char *annotate_dir = NULL;
 
 	err = 0;
-	while ((c = getopt(argc, argv, ":?d:v:sw:h:j:t:u:br:4e:V:pE")) != EOF) {
+	while ((c = getopt_long(argc, argv,
+		":?d:v:sw:h:j:t:m:T:f:z:L:u:br:4nS:e:V:pEc:o:Ra:",
+		long_options, NULL)) != EOF) {
 		switch (c) {  
 			case '?':
 				usage();
@@ -516,9 +619,27 @@ int main(int argc, char** argv) {
 			case 'p':
 				position_flag++;
 				break;
+			case 'c':
+				control_file = optarg;
+				break;
+			case 'o':
+				result_file = optarg;
+				break;
+			case 'R':
+				robust_flag++;
+				break;
+			case 'a':
+				annotate_dir = optarg;
+				break;
 			case '4':
 				b_16_flag++;
 				break;
+			case 'n':
+				no_alpha_flag++;
+				break;
+			case 'S':
+				strip_rows = atoi(optarg);
+				break;
 			case 'r':
 				stitch_flag++;
 				if (optarg && strcmp(optarg, ":")) {
@@ -542,12 +663,36 @@ int main(int argc, char** argv) {
 				}
 				break;
 			case 'j':
-				jpeg_flag++;
-				outpath = optarg;
+				stitch_outputs.jpeg = optarg;
 				break;
 			case 't':
-				tiff_flag++;
-				outpath = optarg;
+				stitch_outputs.tiff = optarg;
+				break;
+			case 'm':
+				stitch_outputs.raw = optarg;
+				break;
+			case 'T':
+				stitch_outputs.thumb = optarg;
+				break;
+			case 'f':
+				stitch_outputs.thumb_factor = atoi(optarg);
+				break;
+			case 'z':
+				stitch_outputs.tiles = optarg;
+				break;
+			case 'L':
+				stitch_outputs.serve = optarg;
+				break;
+			case 'K':
+				if (sscanf(optarg, "%d/%d", &stitch_outputs.shard,
+					&stitch_outputs.num_shards) != 2 ||
+					stitch_outputs.shard < 0 ||
+					stitch_outputs.shard >= stitch_outputs.num_shards) {
+					err++;
+				}
+				break;
+			case 'M':
+				merge_flag++;
 				break;
 			case 'w':
 				stitch_w = atoi(optarg);
@@ -576,32 +721,53 @@ int main(int argc, char** argv) {
 	if (data_file == NULL)
 		data_file = file_installed_or_local(GIPFEL_DATADIR, "gipfel.dat");
 
+	if (stitch_outputs.num_shards > 0 && !stitch_flag) {
+		fprintf(stderr, "--shard needs stitch mode (-s).\n");
+		err++;
+	}
+
 	if (data_file == NULL || err) {
 		usage();
 		exit(1);
 	}
 
-	if (stitch_flag) {
-		int type = 0;
-		if (jpeg_flag) {
-			type = STITCH_JPEG;
-		} else if (tiff_flag) {
-			type = STITCH_TIFF;
-		} else {
+	if (stitch_outputs.jpeg)
+		type |= STITCH_JPEG;
+	if (stitch_outputs.tiff)
+		type |= STITCH_TIFF;
+	if (stitch_outputs.raw)
+		type |= STITCH_RAW;
+	if (stitch_outputs.thumb)
+		type |= STITCH_THUMB;
+	if (stitch_outputs.tiles)
+		type |= STITCH_TILES;
+	if (stitch_outputs.serve)
+		type = STITCH_SERVE;
+	stitch_outputs.visibility = visibility;
+
+	if (merge_flag) {
+		return merge(b_16_flag, !no_alpha_flag, strip_rows, type,
+			&stitch_outputs, my_argc, my_argv);
+	} else if (stitch_flag) {
+		if (type == 0)
 			type = STITCH_PREVIEW;
-		}
 
 		return stitch(bicubic_flag ? ScanImage::BICUBIC : ScanImage::NEAREST,
-			b_16_flag,
+			b_16_flag, !no_alpha_flag, strip_rows,
 			stitch_w, stitch_h, stitch_from, stitch_to,
-			type, outpath, my_argc, my_argv);
+			type, &stitch_outputs, my_argc, my_argv);
 
 	} else if (export_flag) {
 		return export_hills(export_file, visibility);
 	} else if (position_flag) {
 		return export_position();
+	} else if (control_file) {
+		return calibrate(control_file, result_file, robust_flag);
+	} else if (annotate_dir) {
+		return annotate(annotate_dir, visibility, my_argc, my_argv);
 	}
 
+	Fl::lock(); // allow Fl::awake() from the GipfelWidget worker
 	Fl::get_system_colors();
 	if (getenv("FLTK_SCHEME"))
 		Fl::scheme(NULL);
@@ -620,8 +786,13 @@ int main(int argc, char** argv) {
 	scroll = new Fl_Scroll(0, 0, view_win->w(), view_win->h());
 
 	gipf = new GipfelWidget(0, 0, 800, 600, set_values);
+	gipf->start_worker();
+
+	// Parse the data file, decode the image and read its meta data
+	// in parallel. The windows show a preview meanwhile.
+	gipf->load_data(data_file, true);
 	if (img_file) {
-		gipf->load_image(img_file);
+		gipf->load_image(img_file, true);
 		view_win->label(img_file);
 		control_win->label(img_file);
 	}
@@ -633,7 +804,6 @@ int main(int argc, char** argv) {
 	view_win->size(std::min(gipf->w(), sw), std::min(gipf->h(), sh));
 	scroll->size(view_win->w(), view_win->h());
 
-	gipf->load_data(data_file);
 	gipf->set_height_dist_ratio(visibility);
 
 	scroll->end();  
@@ -646,6 +816,10 @@ int main(int argc, char** argv) {
 	view_win->show(1, argv); 
 	control_win->show(1, argv); 
 
+	// viewpoints are looked up among the hills
+	while (gipf->loading_data())
+		Fl::wait();
+
 	if (view_point)
 		gipf->set_viewpoint(view_point);
 	else if (img_file && 
@@ -655,27 +829,110 @@ int main(int argc, char** argv) {
 	return Fl::run();
 }
 
+// Add the file outputs of type to st. Returns the tile output, which
+// wants labels, if any.
+static TileOutputImage *
+add_outputs(Stitch *st, int b_16, int alpha, int strip_rows, int type,
+	const stitch_outputs_t *outputs) {
+	TileOutputImage *tiles = NULL;
+
+	if (type & STITCH_JPEG) {
+		JPEGOutputImage *jpeg = new JPEGOutputImage(outputs->jpeg, 90);
+
+		jpeg->set_parallel(true);
+		st->add_output(jpeg);
+	}
+
+	if (type & STITCH_TIFF) {
+		TIFFOutputImage *tiff =
+			new TIFFOutputImage(outputs->tiff, b_16 ? 16 : 8);
+
+		tiff->set_alpha(alpha);
+		tiff->set_rows_per_strip(strip_rows);
+		st->add_output(tiff);
+	}
+
+	if (type & STITCH_RAW) {
+		RawOutputImage *raw =
+			new RawOutputImage(outputs->raw, b_16 ? 16 : 8);
+
+		raw->set_coverage(alpha);
+		st->add_output(raw);
+	}
+
+	if (type & STITCH_THUMB) {
+		JPEGOutputImage *thumb = new JPEGOutputImage(outputs->thumb, 90);
+
+		st->add_output(new ReduceOutputImage(thumb, outputs->thumb_factor));
+	}
+
+	if (type & STITCH_TILES) {
+		tiles = new TileOutputImage(outputs->tiles);
+		st->add_output(tiles);
+	}
+
+	return tiles;
+}
+
 static int
-stitch(ScanImage::mode_t m, int b_16,
+stitch(ScanImage::mode_t m, int b_16, int alpha, int strip_rows,
 	int stitch_w, int stitch_h, double from, double to,
-	int type, const char *path, int argc, char **argv) {
+	int type, const stitch_outputs_t *outputs, int argc, char **argv) {
 
 	Fl_Window *win;
 	Fl_Scroll *scroll;
 	Stitch *st = new Stitch();
 
+	if (outputs->num_shards > 0 && type != STITCH_RAW) {
+		fprintf(stderr, "--shard needs -m as the only output.\n");
+		return 1;
+	}
+
 	for (int i = 0; i < argc; i++)
 		st->load_image(argv[i]);
 
-	if (type & STITCH_JPEG) {
+	if (type == STITCH_SERVE) {
+
+		TileServer srv(st, m, stitch_w, stitch_h, from, to);
+
+		if (srv.listen(outputs->serve) != 0)
+			return 1;
+
+		fprintf(stderr, "Serving %s/pano.dzi\n", outputs->serve);
+
+		return srv.run();
 
-		st->set_output(new JPEGOutputImage(path, 90));
-		st->resample(m, stitch_w, stitch_h, from, to);
+	} else if (type == STITCH_RAW) {
 
-	} else if (type & STITCH_TIFF) {
+		RawOutputImage *raw = new RawOutputImage(outputs->raw, b_16 ? 16 : 8);
+		int first = 0, last = stitch_h;
 
-		st->set_output(new TIFFOutputImage(path, b_16 ? 16 : 8));
-		st->resample(m, stitch_w, stitch_h, from, to);
+		// each shard is a band of rows
+		if (outputs->num_shards > 0) {
+			first = (int) ((long long) stitch_h * outputs->shard /
+				outputs->num_shards);
+			last = (int) ((long long) stitch_h * (outputs->shard + 1) /
+				outputs->num_shards);
+			raw->set_shard(first, stitch_h);
+		}
+
+		raw->set_coverage(alpha);
+		raw->set_sources(true);
+
+		return st->resample_raw(m, raw, stitch_w, stitch_h, from, to,
+			first, last);
+
+	} else if (!(type & STITCH_PREVIEW)) {
+
+		// All outputs are fed from one resampling pass.
+		TileOutputImage *tiles =
+			add_outputs(st, b_16, alpha, strip_rows, type, outputs);
+
+		if (tiles)
+			st->label_tiles(tiles, data_file, outputs->visibility,
+				stitch_w, stitch_h, from, to);
+
+		return st->resample(m, stitch_w, stitch_h, from, to);
 
 	} else {
 		win = new Fl_Window(0,0, stitch_w, stitch_h);
@@ -685,9 +942,9 @@ stitch(ScanImage::mode_t m, int b_16,
 
 		win->resizable(scroll);
 		win->show(0, argv); 
-		st->set_output(img);
 
-		st->resample(m, stitch_w, stitch_h, from, to);
+		if (st->preview(m, img, stitch_w, stitch_h, from, to) != 0)
+			return 0; // window closed
 
 		img->redraw();
 		Fl::run();
@@ -696,6 +953,38 @@ stitch(ScanImage::mode_t m, int b_16,
 	return 0;
 }
 
+// Assemble the raw files of a sharded stitch into the outputs.
+static int
+merge(int b_16, int alpha, int strip_rows, int type,
+	const stitch_outputs_t *outputs, int argc, char **argv) {
+	RawInputImage **shards;
+	Stitch st;
+	int ret = 0;
+
+	if (argc < 1 || type == 0 || (type & STITCH_SERVE)) {
+		fprintf(stderr, "merge: Shards and file outputs needed.\n");
+		return 1;
+	}
+
+	shards = (RawInputImage **) malloc(argc * sizeof(RawInputImage *));
+	for (int i = 0; i < argc; i++) {
+		shards[i] = new RawInputImage();
+		if (shards[i]->load(argv[i]) != 0)
+			ret = 1;
+	}
+
+	if (ret == 0) {
+		add_outputs(&st, b_16, alpha, strip_rows, type, outputs);
+		ret = st.merge(shards, argc);
+	}
+
+	for (int i = 0; i < argc; i++)
+		delete shards[i];
+	free(shards);
+
+	return ret;
+}
+
 static int
 export_hills(const char *export_file, double visibility) {
 	int ret;
@@ -736,3 +1025,123 @@ export_position() {
 		return 1;
 	}
 }
+
+static int
+calibrate(const char *control_file, const char *result_file, int robust) {
+	ControlPoints cp;
+	Sites sites;
+	FILE *fp = NULL;
+	int ret;
+
+	if (cp.load(control_file) != 0)
+		return 1;
+
+	if (sites.load(data_file) != 0) {
+		fprintf(stderr, "Could not load datafile %s\n", data_file);
+		return 1;
+	}
+
+	if (result_file && (fp = fopen(result_file, "w")) == NULL) {
+		perror("fopen");
+		sites.clobber();
+		return 1;
+	}
+
+	ret = cp.calibrate(&sites, robust, fp);
+
+	if (fp)
+		fclose(fp);
+	sites.clobber();
+
+	return ret;
+}
+
+// Draw the hills into copies of the images, without a display. The
+// data file is loaded once for all images.
+static int
+annotate(const char *dir, double visibility, int argc, char **argv) {
+	char out_dir[MAXPATHLEN], in_dir[MAXPATHLEN], path[MAXPATHLEN];
+	int failed = 0;
+
+	if (argc < 1) {
+		fprintf(stderr, "annotate: No image file given.\n");
+		return 1;
+	}
+
+	if (realpath(dir, out_dir) == NULL) {
+		perror(dir);
+		return 1;
+	}
+
+	gipf = new GipfelWidget(0, 0, 800, 600, NULL);
+	gipf->set_headless();
+
+	if (gipf->load_data(data_file) != 0) {
+		delete gipf;
+		gipf = NULL;
+		return 1;
+	}
+
+	gipf->set_height_dist_ratio(visibility);
+
+	for (int i = 0; i < argc; i++) {
+		char *tmp = strdup(argv[i]);
+		int prev = -1;
+
+		snprintf(path, sizeof(path), "%s/%s", out_dir, basename(tmp));
+
+		// the output is named after the image only
+		for (int j = 0; j < i && prev < 0; j++) {
+			char *a = strdup(argv[i]), *b = strdup(argv[j]);
+
+			if (strcmp(basename(a), basename(b)) == 0)
+				prev = j;
+
+			free(a);
+			free(b);
+		}
+
+		if (prev >= 0) {
+			fprintf(stderr, "%s: Same name as %s, not overwriting %s\n",
+				argv[i], argv[prev], path);
+			free(tmp);
+			failed++;
+			continue;
+		}
+
+		strcpy(tmp, argv[i]);
+
+		if (realpath(dirname(tmp), in_dir) && strcmp(in_dir, out_dir) == 0) {
+			fprintf(stderr, "%s: Not overwriting the image\n", argv[i]);
+			free(tmp);
+			failed++;
+			continue;
+		}
+		free(tmp);
+
+		if (gipf->load_image(argv[i]) != 0) {
+			fprintf(stderr, "%s: Could not read image\n", argv[i]);
+			failed++;
+			continue;
+		}
+
+		if (isnan(gipf->get_view_lat()) || isnan(gipf->get_view_long())) {
+			fprintf(stderr, "%s: Viewpoint unknown\n", argv[i]);
+			failed++;
+			continue;
+		}
+
+		JPEGOutputImage out(path, 90);
+		if (gipf->render(&out) != 0) {
+			fprintf(stderr, "%s: Could not write %s\n", argv[i], path);
+			failed++;
+		}
+	}
+
+	fprintf(stderr, "Annotated %d of %d images\n", argc - failed, argc);
+
+	delete gipf;
+	gipf = NULL;
+
+	return failed != 0;
+}